@@ -11,6 +11,10 @@
 #include <linux/if_ether.h>
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/prefetch.h>
+#include <linux/version.h>
 #include <asm/barrier.h>
 
 #include "main.h"
@@ -32,11 +36,24 @@ enum {
 	SregionBottom	= 0x0c,		/* Bottom of shared region */
         EthaddrTop      = 0x10,         /* Top-half of ether address */
         EthaddrBottom   = 0x14,         /* Bottom-half of ether address */
+	Queues		= 0x18,		/* Number of ring pairs */
+	QueueSel	= 0x1c,		/* Ring pair selected by Sregion* */
+	RingFormat	= 0x20,		/* Ring protocol used by the guest */
+	RingSize	= 0x24,		/* Ring entries offered/accepted */
+	ChainMax	= 0x28,		/* TX slots one frame may take */
 };
 
 struct kvm_ivshmem_device ivs_info;
 
-static int kick_host(struct kvm_ivshmem_device *ivs_info);
+static int ring_format = RING_FORMAT_FLAG;
+module_param(ring_format, int, S_IRUGO);
+MODULE_PARM_DESC(ring_format, "Ring protocol (0 = flag ring, 1 = split ring)");
+
+static int ring_size = 0;
+module_param(ring_size, int, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Ring entries (0 = as many as the host offers)");
+
+static int kick_host(struct kvm_ivshmem_device *ivs_info, struct nvoib_queue *queue);
 static int kvm_ivshmem_probe_device (struct pci_dev *pdev, const struct pci_device_id * ent);
 static int request_msix_vectors(struct kvm_ivshmem_device *ivs_info, int nvectors);
 static void free_msix_vectors(struct kvm_ivshmem_device *ivs_info, const int max_vector);
@@ -50,10 +67,10 @@ static struct pci_driver kvm_ivshmem_pci_driver = {
 	.remove		= kvm_ivshmem_remove_device,
 };
 
-static int kick_host(struct kvm_ivshmem_device *ivs_info){
+static int kick_host(struct kvm_ivshmem_device *ivs_info, struct nvoib_queue *queue){
         void __iomem *plx_intscr = ivs_info->regs + Doorbell;
 
-        writel(0, plx_intscr);
+        writel(queue->index, plx_intscr);
 	return 0;
 }
 
@@ -68,15 +85,31 @@ static int init_host(struct kvm_ivshmem_device *ivs_info){
 static int notify_shared_region(struct kvm_ivshmem_device *ivs_info){
 	void __iomem *plx_intscr;
 	uint64_t offset;
+	int i;
+
+	plx_intscr = ivs_info->regs + RingFormat;
+	writel(ivs_info->ring_format, plx_intscr);
 
-	offset = (uint64_t)virt_to_phys((volatile void *)ivs_info->shared_region);
-	printk(KERN_INFO "Notifying shared region buffer to host(%p)\n", (void *)offset);
+	plx_intscr = ivs_info->regs + RingSize;
+	writel(ivs_info->ring_size, plx_intscr);
 
-	plx_intscr = ivs_info->regs + SregionTop;
-	writel(((uint32_t *)&offset)[0], plx_intscr);
+	plx_intscr = ivs_info->regs + Queues;
+	writel(ivs_info->num_queues, plx_intscr);
 
-        plx_intscr = ivs_info->regs + SregionBottom;
-        writel(((uint32_t *)&offset)[1], plx_intscr);
+	for(i = 0; i < ivs_info->num_queues; i++){
+		offset = (uint64_t)virt_to_phys((volatile void *)ivs_info->queue[i].shared_region);
+		printk(KERN_INFO "Notifying shared region %d buffer to host(%p)\n",
+			i, (void *)offset);
+
+		plx_intscr = ivs_info->regs + QueueSel;
+		writel(i, plx_intscr);
+
+		plx_intscr = ivs_info->regs + SregionTop;
+		writel(((uint32_t *)&offset)[0], plx_intscr);
+
+		plx_intscr = ivs_info->regs + SregionBottom;
+		writel(((uint32_t *)&offset)[1], plx_intscr);
+	}
 
 	return 0;
 }
@@ -96,186 +129,818 @@ void nvoib_eth_addr(unsigned char *dev_addr){
 	return;
 }
 
-void nvoib_irq_enable(void){
-	struct shared_region *sr = ivs_info.shared_region;
-	sr->rx.interruptible = 1;
+static volatile uint32_t *nvoib_rx_event(struct nvoib_queue *queue){
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->rx.event;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->rx.event;
+}
+
+struct ring_ctrl *nvoib_ctrl(struct nvoib_queue *queue){
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->ctrl;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->ctrl;
+}
+
+void nvoib_irq_enable(struct nvoib_queue *queue){
+	/* ask for an interrupt when the host completes the slot we wait for */
+	*nvoib_rx_event(queue) = queue->rx_next;
+	mb();
 	return;
 }
 
-void nvoib_irq_disable(void){
-        struct shared_region *sr = ivs_info.shared_region;
-        sr->rx.interruptible = 0;
-        return;
+void nvoib_irq_disable(struct nvoib_queue *queue){
+	/* the host can not reach the slot behind us without filling the ring */
+	*nvoib_rx_event(queue) = (queue->rx_next + ivs_info.ring_size - 1) % ivs_info.ring_size;
+	return;
 }
 
-netdev_tx_t nvoib_tx(struct sk_buff *skb, struct net_device *dev){
-	struct shared_region *sr = ivs_info.shared_region;
-	static uint32_t next_index = 0;
-	int flag;
+/*
+ * Fill in the offload part of a TX descriptor. TSO frames are cut and
+ * checksummed by the host, everything else leaves here complete.
+ */
+static int nvoib_tx_offload(struct sk_buff *skb, uint16_t *desc_flags, uint16_t *gso_size){
+	*desc_flags = 0;
+	*gso_size = 0;
+
+	/* chains longer than the host gathers or the ring holds are flattened */
+	if(skb_has_frag_list(skb) || skb_shinfo(skb)->nr_frags + 1 > ivs_info.tx_chain_max){
+		if(skb_linearize(skb)){
+			return -ENOMEM;
+		}
+	}
 
-	/* add skb to tx ring buffer */
-	rmb();
-	flag = sr->tx.buf[next_index].flag;
-	if(flag == ENTRY_COMPLETE){
-		struct sk_buff *skb_old;
-		int index;
+	if(skb_is_gso(skb)){
+		if(skb_shinfo(skb)->gso_type & SKB_GSO_TCPV4){
+			*desc_flags = DESC_F_TSO4;
+		}else{
+			*desc_flags = DESC_F_TSO6;
+		}
+		*gso_size = skb_shinfo(skb)->gso_size;
+		return 0;
+	}
+
+	if(skb->ip_summed == CHECKSUM_PARTIAL){
+		return skb_checksum_help(skb);
+	}
 
-		index = next_index;
-		next_index = (index + 1) % RING_SIZE;
+	return 0;
+}
 
-		rmb();
-		skb_old = (struct sk_buff *)sr->tx.buf[index].skb;
-		if(skb_old != NULL){
-			kfree_skb(skb_old);
+/* the host only understands plain TCP headers behind the IP header */
+static int nvoib_tx_host_gso(struct sk_buff *skb){
+	if(skb_shinfo(skb)->gso_type & SKB_GSO_TCPV4){
+		return ip_hdr(skb)->protocol == IPPROTO_TCP;
+	}
+
+	if(skb_shinfo(skb)->gso_type & SKB_GSO_TCPV6){
+		return ipv6_hdr(skb)->nexthdr == IPPROTO_TCP;
+	}
+
+	return 0;
+}
+
+/* guest physical address and length of every part of the frame */
+static int nvoib_tx_map(struct sk_buff *skb, uint64_t *addr, uint32_t *len){
+	int i, num = 0;
+
+	if(skb_headlen(skb)){
+		addr[num]	= (uint64_t)virt_to_phys((volatile void *)skb->data);
+		len[num++]	= skb_headlen(skb);
+	}
+
+	/* page cache and sendfile payloads are handed over where they are */
+	for(i = 0; i < skb_shinfo(skb)->nr_frags; i++){
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+		if(!skb_frag_size(frag)){
+			continue;
 		}
+		addr[num]	= (uint64_t)page_to_phys(skb_frag_page(frag)) + skb_frag_off(frag);
+		len[num++]	= skb_frag_size(frag);
+	}
 
-		/* release wmem or rmem */
-		if(skb->destructor != NULL){
-			skb->destructor(skb);
-			skb->destructor = NULL;
+	return num;
+}
+
+/* free slots, those from tx_clean up to tx_next still belong to the host */
+static uint32_t nvoib_tx_room(struct nvoib_queue *queue){
+	return (READ_ONCE(queue->tx_clean) + ivs_info.ring_size - queue->tx_next - 1)
+		% ivs_info.ring_size;
+}
+
+/* stop while a frame of the longest chain might not fit, NAPI wakes us up */
+static void nvoib_tx_maybe_stop(struct nvoib_queue *queue, struct netdev_queue *txq){
+	if(likely(nvoib_tx_room(queue) >= ivs_info.tx_chain_max)){
+		return;
+	}
+
+	netif_tx_stop_queue(txq);
+
+	/* a reclaim running right now may not have seen the stop */
+	smp_mb();
+	if(nvoib_tx_room(queue) >= ivs_info.tx_chain_max){
+		netif_tx_start_queue(txq);
+	}
+}
+
+/*
+ * Ring the doorbell once for everything published since the last call.
+ * Frames are made visible to the host as they come, a polling host
+ * picks them up without waiting for the end of the burst.
+ */
+static void nvoib_tx_kick(struct nvoib_queue *queue){
+	uint32_t event;
+
+	if(queue->tx_kicked == queue->tx_next){
+		return;
+	}
+
+	mb();
+	if(ivs_info.ring_format != RING_FORMAT_SPLIT){
+		event = ((struct shared_region *)queue->shared_region)->tx.event;
+	}else{
+		event = ((struct split_region *)queue->shared_region)->tx.event;
+	}
+
+	if(nvoib_need_event(ivs_info.ring_size, event, queue->tx_next, queue->tx_kicked)){
+		/* wake up host OS */
+		kick_host(&ivs_info, queue);
+	}
+
+	queue->tx_kicked = queue->tx_next;
+}
+
+static netdev_tx_t nvoib_tx_split(struct sk_buff *skb, struct nvoib_queue *queue,
+	uint16_t desc_flags, uint16_t gso_size, int more){
+	struct split_region *sr = queue->shared_region;
+	struct netdev_queue *txq = netdev_get_tx_queue(ip_dev, queue->index);
+	uint64_t addr[DESC_CHAIN_MAX];
+	uint32_t len[DESC_CHAIN_MAX];
+	unsigned int bytes = skb->len;
+	int head, index, i, num;
+
+	num = nvoib_tx_map(skb, addr, len);
+
+	head = queue->tx_next;
+	if(unlikely(nvoib_tx_room(queue) < num)){
+		/* the queue is stopped before this can happen */
+		netif_tx_stop_queue(txq);
+		nvoib_tx_kick(queue);
+		return NETDEV_TX_BUSY;
+	}
+
+	for(i = 0; i < num; i++){
+		index = (head + i) % ivs_info.ring_size;
+
+		/* the skb goes with the last slot of its chain */
+		queue->tx_skb[index]		= (i == num - 1) ? skb : NULL;
+		sr->tx.desc[index].data_ptr	= addr[i];
+		sr->tx.desc[index].size		= len[i];
+		sr->tx.desc[index].desc_flags	= (i ? 0 : desc_flags)
+						| (i == num - 1 ? 0 : DESC_F_NEXT);
+		sr->tx.desc[index].gso_size	= i ? 0 : gso_size;
+	}
+
+	/* the host may complete it as soon as avail moves */
+	netdev_tx_sent_queue(txq, bytes);
+
+	wmb();
+	queue->tx_next = (head + num) % ivs_info.ring_size;
+	sr->tx.avail = queue->tx_next;
+
+	ip_dev->stats.tx_packets++;
+	ip_dev->stats.tx_bytes += bytes;
+
+	nvoib_tx_maybe_stop(queue, txq);
+	if(!more || netif_xmit_stopped(txq)){
+		nvoib_tx_kick(queue);
+	}
+	return NETDEV_TX_OK;
+}
+
+static netdev_tx_t nvoib_tx_flag(struct sk_buff *skb, struct nvoib_queue *queue,
+	uint16_t desc_flags, uint16_t gso_size, int more){
+	struct shared_region *sr = queue->shared_region;
+	struct netdev_queue *txq = netdev_get_tx_queue(ip_dev, queue->index);
+	uint64_t addr[DESC_CHAIN_MAX];
+	uint32_t len[DESC_CHAIN_MAX];
+	unsigned int bytes = skb->len;
+	int head, index, i, num;
+
+	num = nvoib_tx_map(skb, addr, len);
+
+	head = queue->tx_next;
+	if(unlikely(nvoib_tx_room(queue) < num)){
+		/* the queue is stopped before this can happen */
+		netif_tx_stop_queue(txq);
+		nvoib_tx_kick(queue);
+		return NETDEV_TX_BUSY;
+	}
+
+	/* add skb to tx ring buffer */
+	for(i = 0; i < num; i++){
+		index = (head + i) % ivs_info.ring_size;
+
+		/* the skb goes with the last slot of its chain */
+		queue->tx_skb[index]		= (i == num - 1) ? skb : NULL;
+		sr->tx.buf[index].data_ptr	= addr[i];
+		sr->tx.buf[index].size		= len[i];
+		sr->tx.buf[index].desc_flags	= (i ? 0 : desc_flags)
+						| (i == num - 1 ? 0 : DESC_F_NEXT);
+		sr->tx.buf[index].gso_size	= i ? 0 : gso_size;
+
+		/* the host does not look behind the first slot before it is flipped */
+		if(i){
+			sr->tx.buf[index].flag	= ENTRY_AVAILABLE;
 		}
+	}
 
-		sr->tx.buf[index].data_ptr	= (uint64_t)virt_to_phys((volatile void *)skb->data);
-		sr->tx.buf[index].skb		= (uint64_t)skb;
-		sr->tx.buf[index].size		= skb->len;
-		wmb();
-		sr->tx.buf[index].flag		= ENTRY_AVAILABLE;
-		wmb();
+	/* the host may complete it as soon as the first flag flips */
+	netdev_tx_sent_queue(txq, bytes);
+
+	wmb();
+	sr->tx.buf[head].flag		= ENTRY_AVAILABLE;
+
+	/* reclaim only looks at slots before tx_next, which are no longer COMPLETE */
+	smp_wmb();
+	queue->tx_next = (head + num) % ivs_info.ring_size;
+
+        ip_dev->stats.tx_packets++;
+        ip_dev->stats.tx_bytes += bytes;
+
+	nvoib_tx_maybe_stop(queue, txq);
+	if(!more || netif_xmit_stopped(txq)){
+		nvoib_tx_kick(queue);
+	}
+	return NETDEV_TX_OK;
+}
+
+/* has the host handed back the slot at tx_clean */
+static int nvoib_tx_done(struct nvoib_queue *queue){
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return READ_ONCE(((struct split_region *)queue->shared_region)->tx.used)
+			!= queue->tx_clean;
+	}
 
-		if(sr->tx.interruptible){
-			/* wake up host OS */
-			kick_host(&ivs_info);
-			/* temporary for debugging */
-			ip_dev->stats.tx_errors++;
+	return queue->tx_clean != READ_ONCE(queue->tx_next)
+		&& ((struct shared_region *)queue->shared_region)->tx.buf[queue->tx_clean].flag
+			== ENTRY_COMPLETE;
+}
+
+static volatile uint32_t *nvoib_tx_comp_event(struct nvoib_queue *queue){
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->tx.comp_event;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->tx.comp_event;
+}
+
+/*
+ * Free the skbs the host is done with, from NAPI. The host interrupts
+ * us once the slot at tx_clean completes, so sockets get their memory
+ * back soon after the send and not only when the slot is reused.
+ */
+static void nvoib_tx_clean(struct nvoib_queue *queue){
+	struct netdev_queue *txq = netdev_get_tx_queue(ip_dev, queue->index);
+	struct sk_buff *skb;
+	unsigned int pkts = 0, bytes = 0;
+	uint32_t index;
+
+	do{
+		while(nvoib_tx_done(queue)){
+			rmb();
+			index = queue->tx_clean;
+
+			skb = queue->tx_skb[index];
+			if(skb != NULL){
+				pkts++;
+				bytes += skb->len;
+				dev_kfree_skb_any(skb);
+				queue->tx_skb[index] = NULL;
+			}
+
+			WRITE_ONCE(queue->tx_clean, (index + 1) % ivs_info.ring_size);
 		}
 
-                ip_dev->stats.tx_packets++;
-                ip_dev->stats.tx_bytes += skb->len;
-	}else{
-		if(flag == ENTRY_INFLIGHT){
-			ip_dev->stats.tx_dropped++;
-		}else if(flag == ENTRY_AVAILABLE){
-			ip_dev->stats.tx_errors++;
+		/* ask for the next completion, then look again for one we raced with */
+		*nvoib_tx_comp_event(queue) = queue->tx_clean;
+		mb();
+	}while(nvoib_tx_done(queue));
+
+	if(!pkts){
+		return;
+	}
+
+	netdev_tx_completed_queue(txq, pkts, bytes);
+
+	if(unlikely(netif_tx_queue_stopped(txq))
+	&& nvoib_tx_room(queue) >= ivs_info.tx_chain_max){
+		netif_tx_wake_queue(txq);
+	}
+}
+
+static netdev_tx_t nvoib_tx_one(struct sk_buff *skb, struct nvoib_queue *queue, int more){
+	uint16_t desc_flags, gso_size;
+
+	if(nvoib_tx_offload(skb, &desc_flags, &gso_size)){
+		ip_dev->stats.tx_dropped++;
+		kfree_skb(skb);
+
+		/* earlier segments may still wait for the doorbell */
+		if(!more){
+			nvoib_tx_kick(queue);
 		}
+		return NETDEV_TX_OK;
+	}
+
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return nvoib_tx_split(skb, queue, desc_flags, gso_size, more);
+	}
+
+	return nvoib_tx_flag(skb, queue, desc_flags, gso_size, more);
+}
+
+netdev_tx_t nvoib_tx(struct sk_buff *skb, struct net_device *dev){
+	struct nvoib_queue *queue = &ivs_info.queue[skb_get_queue_mapping(skb)];
+	struct sk_buff *segs, *next;
+
+	if(!skb_is_gso(skb) || nvoib_tx_host_gso(skb)){
+		return nvoib_tx_one(skb, queue, 0);
+	}
+
+	/* rare layouts are segmented here instead */
+	segs = skb_gso_segment(skb, dev->features & ~NETIF_F_GSO_MASK);
+	if(IS_ERR_OR_NULL(segs)){
+		ip_dev->stats.tx_dropped++;
 		kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+	consume_skb(skb);
+
+	while(segs != NULL){
+		next = segs->next;
+		segs->next = NULL;
+		/* one doorbell for all segments */
+		if(nvoib_tx_one(segs, queue, next != NULL) != NETDEV_TX_OK){
+			ip_dev->stats.tx_dropped++;
+			kfree_skb(segs);
+		}
+		segs = next;
 	}
 
 	return NETDEV_TX_OK;
 }
 
-int nvoib_rx(struct napi_struct *napi, int badget){
-	struct shared_region *sr = ivs_info.shared_region;
-	static uint32_t next_index = 0;
+/* a page whose skb is gone again is reused, otherwise a fresh one is taken */
+static struct page *nvoib_page_get(struct nvoib_queue *queue, gfp_t gfp){
+	struct nvoib_page_pool *pool = &queue->pool;
+	struct page *page;
+
+	if(pool->count){
+		page = pool->page[pool->head];
+		if(page_count(page) == 1){
+			pool->head = (pool->head + 1) % NVOIB_POOL_SIZE;
+			pool->count--;
+			return page;
+		}
+	}
+
+	return alloc_pages(gfp | __GFP_COMP | __GFP_NOWARN, ivs_info.rx_order);
+}
+
+static void nvoib_page_put(struct nvoib_queue *queue, struct page *page){
+	struct nvoib_page_pool *pool = &queue->pool;
+
+	if(pool->count == NVOIB_POOL_SIZE){
+		/* the oldest one is still held by the stack, let it go */
+		put_page(pool->page[pool->head]);
+		pool->head = (pool->head + 1) % NVOIB_POOL_SIZE;
+		pool->count--;
+	}
+
+	pool->page[(pool->head + pool->count) % NVOIB_POOL_SIZE] = page;
+	pool->count++;
+}
+
+static uint64_t nvoib_page_dma(struct page *page){
+	return (uint64_t)page_to_phys(page) + ivs_info.rx_headroom;
+}
+
+/* wrap an skb around a filled page, no copy and no slab allocation for the data */
+static struct sk_buff *nvoib_build_skb(struct nvoib_queue *queue, struct page *page,
+	uint32_t size){
+	struct sk_buff *skb;
+
+	skb = build_skb(page_address(page), ivs_info.rx_truesize);
+	if(unlikely(!skb)){
+		return NULL;
+	}
+
+	skb_reserve(skb, ivs_info.rx_headroom);
+	skb_put(skb, size);
+
+	/* one reference goes with the skb, ours stays in the pool */
+	get_page(page);
+	nvoib_page_put(queue, page);
+	return skb;
+}
+
+/* the host fills slots in order, so the next frame is usually there already */
+static void nvoib_rx_prefetch(struct nvoib_queue *queue, uint32_t index){
+	prefetch(page_address(queue->rx_page[index]) + ivs_info.rx_headroom);
+}
+
+#ifdef NVOIB_BUSY_POLL_NDO
+/*
+ * NAPI and a busy polling socket take turns on the RX ring. A socket
+ * finding NAPI there backs off, NAPI finding a socket comes back later.
+ */
+static int nvoib_napi_lock(struct nvoib_queue *queue){
+	int ret = 1;
+
+	spin_lock(&queue->poll_lock);
+	if(queue->poll_owner & NVOIB_POLL_SOCK){
+		ret = 0;
+	}else{
+		queue->poll_owner = NVOIB_POLL_NAPI;
+	}
+	spin_unlock(&queue->poll_lock);
+
+	return ret;
+}
+
+static void nvoib_napi_unlock(struct nvoib_queue *queue){
+	spin_lock(&queue->poll_lock);
+	queue->poll_owner = NVOIB_POLL_IDLE;
+	spin_unlock(&queue->poll_lock);
+}
+
+static int nvoib_sock_lock(struct nvoib_queue *queue){
+	int ret = 1;
+
+	spin_lock_bh(&queue->poll_lock);
+	if(queue->poll_owner != NVOIB_POLL_IDLE){
+		ret = 0;
+	}else{
+		queue->poll_owner = NVOIB_POLL_SOCK;
+	}
+	spin_unlock_bh(&queue->poll_lock);
+
+	return ret;
+}
+
+static void nvoib_sock_unlock(struct nvoib_queue *queue){
+	spin_lock_bh(&queue->poll_lock);
+	queue->poll_owner = NVOIB_POLL_IDLE;
+	spin_unlock_bh(&queue->poll_lock);
+}
+
+/* tell the host a socket spins on the ring, so that it stops batching completions */
+static inline void nvoib_rx_busy_beat(struct nvoib_queue *queue){
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		((struct split_region *)queue->shared_region)->rx.busy_poll++;
+	}else{
+		((struct shared_region *)queue->shared_region)->rx.busy_poll++;
+	}
+}
+#endif
+
+static void nvoib_rx_skb(struct nvoib_queue *queue, struct sk_buff *skb){
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* sockets learn from this which ring to spin on */
+	skb_mark_napi_id(skb, &queue->napi);
+#endif
+
+#ifdef NVOIB_BUSY_POLL_NDO
+	/* GRO belongs to NAPI, a spinning socket takes its frames one by one */
+	if(queue->poll_owner & NVOIB_POLL_SOCK){
+		netif_receive_skb(skb);
+		return;
+	}
+#endif
+
+	/* bulk TCP is merged here, napi_complete() flushes what is left */
+	napi_gro_receive(&queue->napi, skb);
+}
+
+static void nvoib_rx_deliver(struct nvoib_queue *queue, struct page *page, uint32_t size){
+	struct sk_buff *skb;
+
+	skb = nvoib_build_skb(queue, page, size);
+	if(unlikely(!skb)){
+		ip_dev->stats.rx_dropped++;
+		put_page(page);
+		return;
+	}
+
+	skb->protocol = eth_type_trans(skb, ip_dev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	nvoib_rx_skb(queue, skb);
+
+	ip_dev->stats.rx_packets++;
+	ip_dev->stats.rx_bytes += size;
+}
+
+static int nvoib_rx_split(struct nvoib_queue *queue, int badget){
+	struct split_region *sr = queue->shared_region;
+	uint32_t used;
 	int work_done = 0;
 
 	/* process received buffer */
+	used = sr->rx.used;
 	rmb();
-	while(sr->rx.buf[next_index].flag == ENTRY_COMPLETE && work_done < badget){
-                struct sk_buff *skb;
-                struct sk_buff *skb_new;
+	while(queue->rx_next != used && work_done < badget){
+		struct page *page;
+		struct page *page_new;
 		uint32_t size;
 		int index;
 
+		/* buffer allocation process, usually a page the stack gave back */
+		page_new = nvoib_page_get(queue, GFP_ATOMIC);
+		if(unlikely(!page_new)){
+			printk(KERN_ERR "NVOIB_FATAL: failed to get buffer\n");
+			break;
+		}
+
 		work_done++;
 
-		/* buffer allocation process */
-                skb_new = dev_alloc_skb(ivs_info.ip_align + ivs_info.mtu);
-                if(unlikely(!skb_new)){
-                        printk(KERN_ERR "NVOIB_FATAL: failed to get buffer\n");
-                        break;
-                }
-                skb_reserve(skb_new, ivs_info.ip_align);
+		index = queue->rx_next;
+		queue->rx_next = (index + 1) % ivs_info.ring_size;
+
+		page		= queue->rx_page[index];
+		size		= sr->rx.desc[index].size;
+
+		if(queue->rx_next != used){
+			prefetch(&sr->rx.desc[queue->rx_next]);
+			nvoib_rx_prefetch(queue, queue->rx_next);
+		}
 
-		index = next_index;
-		next_index = (index + 1) % RING_SIZE;
+		/* packet injection process */
+		nvoib_rx_deliver(queue, page, size);
+
+		/* buffer configuration process, published below for the whole batch */
+		index = queue->rx_avail;
+		queue->rx_avail = (index + 1) % ivs_info.ring_size;
+
+		queue->rx_page[index]		= page_new;
+		sr->rx.desc[index].data_ptr	= nvoib_page_dma(page_new);
+		sr->rx.desc[index].size		= ivs_info.mtu;
+	}
+	wmb();
+	sr->rx.avail = queue->rx_avail;
+
+        return work_done;
+}
+
+static int nvoib_rx_flag(struct nvoib_queue *queue, int badget){
+	struct shared_region *sr = queue->shared_region;
+	int work_done = 0;
+
+	/* process received buffer */
+	rmb();
+	while(sr->rx.buf[queue->rx_next].flag == ENTRY_COMPLETE && work_done < badget){
+		struct page *page;
+		struct page *page_new;
+		uint32_t size;
+		int index;
+
+		/* buffer allocation process, usually a page the stack gave back */
+		page_new = nvoib_page_get(queue, GFP_ATOMIC);
+		if(unlikely(!page_new)){
+			printk(KERN_ERR "NVOIB_FATAL: failed to get buffer\n");
+			break;
+		}
+
+		work_done++;
+
+		index = queue->rx_next;
+		queue->rx_next = (index + 1) % ivs_info.ring_size;
 
 		rmb();
-		skb		= (struct sk_buff *)sr->rx.buf[index].skb;
+		page		= queue->rx_page[index];
 		size		= sr->rx.buf[index].size;
 
-		/* packet injection process */
-		skb_put(skb, size - IB_UD_GRH);
-		skb->protocol = eth_type_trans(skb, ip_dev);
-		skb->ip_summed = CHECKSUM_UNNECESSARY;
-		netif_receive_skb(skb);
+		prefetch(&sr->rx.buf[queue->rx_next]);
+		nvoib_rx_prefetch(queue, queue->rx_next);
 
-		ip_dev->stats.rx_packets++;
-		ip_dev->stats.rx_bytes += size;
+		/* packet injection process */
+		nvoib_rx_deliver(queue, page, size);
 
 		/* buffer configuration process */
-		sr->rx.buf[index].skb		= (uint64_t)skb_new;
-                sr->rx.buf[index].data_ptr	= (uint64_t)virt_to_phys((volatile void *)skb_new->data)
-                                                	- IB_UD_GRH;
-                sr->rx.buf[index].size		= ivs_info.mtu + IB_UD_GRH;
+		queue->rx_page[index]		= page_new;
+		sr->rx.buf[index].data_ptr	= nvoib_page_dma(page_new);
+		sr->rx.buf[index].size		= ivs_info.mtu;
 		wmb();
-                sr->rx.buf[index].flag		= ENTRY_AVAILABLE;
+		sr->rx.buf[index].flag		= ENTRY_AVAILABLE;
 	}
 	wmb();
 
+        return work_done;
+}
+
+/* anything completed since the interrupt was turned back on */
+static int nvoib_rx_pending(struct nvoib_queue *queue){
+	struct shared_region *sr;
+	int flag;
+
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return ((struct split_region *)queue->shared_region)->rx.used != queue->rx_next;
+	}
+
+	sr = queue->shared_region;
+	flag = sr->rx.buf[queue->rx_next].flag;
+	if(flag  == ENTRY_COMPLETE){
+		return 1;
+	}else if(flag == ENTRY_INFLIGHT){
+		ip_dev->stats.rx_dropped++;
+	}else if(flag == ENTRY_AVAILABLE){
+		ip_dev->stats.rx_errors++;
+	}
+
+	return 0;
+}
+
+static int nvoib_rx_ring(struct nvoib_queue *queue, int badget){
+	if(ivs_info.ring_format == RING_FORMAT_SPLIT){
+		return nvoib_rx_split(queue, badget);
+	}
+
+	return nvoib_rx_flag(queue, badget);
+}
+
+int nvoib_rx(struct napi_struct *napi, int badget){
+	struct nvoib_queue *queue = container_of(napi, struct nvoib_queue, napi);
+	int work_done;
+
+	/* TX completions share the queue's vector */
+	nvoib_tx_clean(queue);
+
+#ifdef NVOIB_BUSY_POLL_NDO
+	/* a socket is spinning on the ring, stay scheduled and look again */
+	if(!nvoib_napi_lock(queue)){
+		return badget;
+	}
+#endif
+
+	work_done = nvoib_rx_ring(queue, badget);
+
+#ifdef NVOIB_BUSY_POLL_NDO
+	nvoib_napi_unlock(queue);
+#endif
+
 	if(work_done < badget){
-		int flag;
-		nvoib_irq_enable();
 		napi_complete(napi);
-		flag = sr->rx.buf[next_index].flag;
-		if(flag  == ENTRY_COMPLETE){
-			nvoib_irq_disable();
+		nvoib_irq_enable(queue);
+		if(nvoib_rx_pending(queue)){
+			nvoib_irq_disable(queue);
 			napi_schedule(napi);
-		}else if(flag == ENTRY_INFLIGHT){
-			ip_dev->stats.rx_dropped++;
-		}else if(flag == ENTRY_AVAILABLE){
-			ip_dev->stats.rx_errors++;
 		}
 	}
 
-        return work_done;
+	return work_done;
+}
+
+#ifdef NVOIB_BUSY_POLL_NDO
+/* a blocked socket spins on the RX ring instead of waiting for the interrupt */
+int nvoib_busy_poll(struct napi_struct *napi){
+	struct nvoib_queue *queue = container_of(napi, struct nvoib_queue, napi);
+	int work_done;
+
+	if(unlikely(!netif_running(ip_dev))){
+		return LL_FLUSH_FAILED;
+	}
+
+	if(!nvoib_sock_lock(queue)){
+		return LL_FLUSH_BUSY;
+	}
+
+	nvoib_rx_busy_beat(queue);
+	work_done = nvoib_rx_ring(queue, NVOIB_BUSY_POLL_BADGET);
+
+	nvoib_sock_unlock(queue);
+	return work_done;
 }
+#endif
 
-static int prepare_shared_region(struct kvm_ivshmem_device *dev){
+static int prepare_split_region(struct kvm_ivshmem_device *dev, struct nvoib_queue *queue){
+	struct split_region *sr;
+	int i;
+
+	sr = kmalloc(sizeof(struct split_region), GFP_KERNEL);
+	if(unlikely(!sr)){
+		return -1;
+	}
+	memset(sr, 0, sizeof(struct split_region));
+
+	/* one slot stays empty so that avail == used always means "nothing posted" */
+	for(i = 0; i < dev->ring_size - 1; i++){
+		queue->rx_page[i] = nvoib_page_get(queue, GFP_KERNEL);
+		if(unlikely(!queue->rx_page[i])){
+			printk(KERN_ERR "NVOIB_FATAL: failed to get buffer\n");
+			return -1;
+		}
+
+		sr->rx.desc[i].data_ptr	= nvoib_page_dma(queue->rx_page[i]);
+		sr->rx.desc[i].size	= dev->mtu;
+	}
+	queue->rx_avail = dev->ring_size - 1;
+	sr->rx.avail = queue->rx_avail;
+	sr->rx.event = dev->ring_size - 1;	/* no interrupt until netdev_up() */
+	sr->ctrl.coal_adaptive = 1;
+	wmb();
+
+	queue->shared_region = sr;
+	return 0;
+}
+
+static int prepare_shared_region(struct kvm_ivshmem_device *dev, struct nvoib_queue *queue){
 	struct shared_region *sr;
 	int i;
 
+	queue->rx_page = kcalloc(dev->ring_size, sizeof(struct page *), GFP_KERNEL);
+	if(unlikely(!queue->rx_page)){
+		return -1;
+	}
+
+	queue->tx_skb = kcalloc(dev->ring_size, sizeof(struct sk_buff *), GFP_KERNEL);
+	if(unlikely(!queue->tx_skb)){
+		return -1;
+	}
+
+	if(dev->ring_format == RING_FORMAT_SPLIT){
+		return prepare_split_region(dev, queue);
+	}
+
 	sr = kmalloc(sizeof(struct shared_region), GFP_KERNEL);
 	if(unlikely(!sr)){
 		return -1;
 	}
 	memset(sr, 0, sizeof(struct shared_region));
 
-	for(i = 0; i < RING_SIZE; i++){
-		struct sk_buff *skb;
-		
-                skb = dev_alloc_skb(dev->ip_align + dev->mtu);
-                if(unlikely(!skb)){
-                        printk(KERN_ERR "NVOIB_FATAL: failed to get buffer\n");
-                        return -1;
-                }
-
-		skb_reserve(skb, dev->ip_align);
+	for(i = 0; i < dev->ring_size; i++){
+		queue->rx_page[i] = nvoib_page_get(queue, GFP_KERNEL);
+		if(unlikely(!queue->rx_page[i])){
+			printk(KERN_ERR "NVOIB_FATAL: failed to get buffer\n");
+			return -1;
+		}
 
-		sr->rx.buf[i].skb	= (uint64_t)skb;
-		sr->rx.buf[i].data_ptr	= (uint64_t)virt_to_phys((volatile void *)skb->data)
-						- IB_UD_GRH;
-		sr->rx.buf[i].size	= dev->mtu + IB_UD_GRH;
+		sr->rx.buf[i].skb	= 0;
+		sr->rx.buf[i].data_ptr	= nvoib_page_dma(queue->rx_page[i]);
+		sr->rx.buf[i].size	= dev->mtu;
 		sr->rx.buf[i].flag	= ENTRY_AVAILABLE;
 	}
+	sr->rx.event = dev->ring_size - 1;	/* no interrupt until netdev_up() */
+	sr->ctrl.coal_adaptive = 1;
 	wmb();
 
-	dev->shared_region = sr;
+	queue->shared_region = sr;
 	return 0;
 }
 
-static void nvoib_set_mtu(struct kvm_ivshmem_device *dev){
-	dev->ip_align = NET_IP_ALIGN;
+static int prepare_queues(struct kvm_ivshmem_device *dev){
+	uint32_t max_queues;
+	int i;
+
+	/* one ring pair per online CPU, up to what the host offers */
+	max_queues = readl(dev->regs + Queues);
+	dev->num_queues = min_t(int, num_online_cpus(), max_queues);
+	dev->num_queues = clamp_t(int, dev->num_queues, 1, NVOIB_MAX_QUEUES);
 
-	while((NET_SKB_PAD + dev->ip_align) < IB_UD_GRH){
-		dev->ip_align += L1_CACHE_BYTES;
+	dev->queue = kzalloc(NVOIB_MAX_QUEUES * sizeof(struct nvoib_queue), GFP_KERNEL);
+	if(unlikely(!dev->queue)){
+		return -1;
+	}
+
+	for(i = 0; i < NVOIB_MAX_QUEUES; i++){
+		dev->queue[i].index = i;
+#ifdef NVOIB_BUSY_POLL_NDO
+		spin_lock_init(&dev->queue[i].poll_lock);
+#endif
 	}
 
+	return 0;
+}
+
+static void nvoib_set_mtu(struct kvm_ivshmem_device *dev){
 	dev->mtu = IB_MTU;
+
+	/* the host splits the GRH off, the headroom is only what the stack wants */
+	dev->rx_headroom = NET_SKB_PAD + NET_IP_ALIGN;
+	dev->rx_truesize = SKB_DATA_ALIGN(dev->rx_headroom + dev->mtu)
+		+ SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+	dev->rx_order = get_order(dev->rx_truesize);
+	dev->rx_truesize = PAGE_SIZE << dev->rx_order;
 	return;
 }
 
 static int kvm_ivshmem_probe_device (struct pci_dev *pdev, const struct pci_device_id * ent) {
-	int result;
+	uint32_t chain_max;
+	int result, i;
 
 	printk(KERN_INFO "IVSHMEM_NIC: Probing for PCI Device\n");
 
@@ -292,11 +957,6 @@ static int kvm_ivshmem_probe_device (struct pci_dev *pdev, const struct pci_devi
 		goto pci_disable;
 	}
 
-	if(prepare_shared_region(&ivs_info) < 0){
-		printk(KERN_ERR "failed to get shared region buffer\n");
-		goto pci_disable;
-	}
-
 	ivs_info.regaddr =  pci_resource_start(pdev, 0);
 	ivs_info.reg_size = pci_resource_len(pdev, 0);
 	ivs_info.regs = pci_ioremap_bar(pdev, 0);
@@ -306,14 +966,51 @@ static int kvm_ivshmem_probe_device (struct pci_dev *pdev, const struct pci_devi
 		goto pci_release;
 	}
 
-	notify_shared_region(&ivs_info);
+	if(prepare_queues(&ivs_info) < 0){
+		printk(KERN_ERR "failed to get queues\n");
+		goto pci_release;
+	}
 
 	ivs_info.dev = pdev;
-	if (request_msix_vectors(&ivs_info, 4) != 0) {
+	if (request_msix_vectors(&ivs_info, ivs_info.num_queues) != 0) {
 		printk(KERN_INFO "IVSHMEM_NIC: MSI-X disabled\n");
 		goto pci_release;
 	}
 
+	/* each RX ring needs its own vector */
+	ivs_info.num_queues = ivs_info.nvectors;
+
+	ivs_info.ring_format = ring_format;
+	if(ring_format != RING_FORMAT_FLAG && ring_format != RING_FORMAT_SPLIT){
+		printk(KERN_INFO "IVSHMEM_NIC: unknown ring format %d, using flag ring\n", ring_format);
+		ivs_info.ring_format = RING_FORMAT_FLAG;
+	}
+
+	/* hosts without RingSize read as 0 and use the full layout */
+	ivs_info.ring_size = readl(ivs_info.regs + RingSize);
+	if(ivs_info.ring_size == 0 || ivs_info.ring_size > RING_SIZE){
+		ivs_info.ring_size = RING_SIZE;
+	}
+	if(ring_size >= 2 && ring_size < ivs_info.ring_size){
+		ivs_info.ring_size = ring_size;
+	}
+
+	/* hosts without ChainMax read as 0 and gather every fragment */
+	chain_max = readl(ivs_info.regs + ChainMax);
+	if(chain_max == 0 || chain_max > DESC_CHAIN_MAX){
+		chain_max = DESC_CHAIN_MAX;
+	}
+	ivs_info.tx_chain_max = min_t(uint32_t, chain_max, ivs_info.ring_size - 1);
+
+	for(i = 0; i < ivs_info.num_queues; i++){
+		if(prepare_shared_region(&ivs_info, &ivs_info.queue[i]) < 0){
+			printk(KERN_ERR "failed to get shared region buffer\n");
+			goto pci_release;
+		}
+	}
+
+	notify_shared_region(&ivs_info);
+
 	pci_set_drvdata(pdev, &ivs_info);
 
 	init_host(&ivs_info);
@@ -363,9 +1060,9 @@ static int request_msix_vectors(struct kvm_ivshmem_device *ivs_info, int nvector
 	printk(KERN_INFO "IVSHMEM_NIC: Succeed to enable MSI-X.\n");
 
 	for (i = 0; i < ivs_info->nvectors; i++) {
-		snprintf(ivs_info->msix_names[i], sizeof(*ivs_info->msix_names), "%s-config", name);
+		snprintf(ivs_info->msix_names[i], sizeof(*ivs_info->msix_names), "%s-rx%d", name, i);
 		err = request_irq(ivs_info->msix_entries[i].vector, nvoib_interrupt, 0,
-			ivs_info->msix_names[i], ivs_info);
+			ivs_info->msix_names[i], &ivs_info->queue[i]);
 
 		if (err) {
 			printk(KERN_INFO "IVSHMEM_NIC: Unable to get irq = %d.\n", err);
@@ -389,7 +1086,7 @@ static void free_msix_vectors(struct kvm_ivshmem_device *ivs_info, const int max
         int i;
 
         for (i = 0; i < max_vector; i++){
-                free_irq(ivs_info->msix_entries[i].vector, ivs_info);
+                free_irq(ivs_info->msix_entries[i].vector, &ivs_info->queue[i]);
 	}
 }
 
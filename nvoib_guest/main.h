@@ -1,7 +1,35 @@
-#define RING_SIZE 12800
+#define RING_SIZE 12800	/* largest ring, fixes the shared region layout */
+#define NVOIB_MAX_QUEUES 16
 #define NAPI_POLL_WEIGHT 64
 #define IB_UD_GRH 40
 #define IB_MTU 4096
+#define NVOIB_POOL_SIZE 256	/* pages per queue waiting to come back from the stack */
+
+/* sockets may spin on our RX rings through ndo_busy_poll, which went away in 4.5 */
+#ifdef CONFIG_NET_RX_BUSY_POLL
+#include <net/busy_poll.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+#define NVOIB_BUSY_POLL_NDO
+#define NVOIB_BUSY_POLL_BADGET 4
+
+#define NVOIB_POLL_IDLE 0
+#define NVOIB_POLL_NAPI 0x1		/* NAPI owns the RX ring */
+#define NVOIB_POLL_SOCK 0x2		/* a busy polling socket owns the RX ring */
+#endif
+#endif
+
+/* skb_frag_t is a bio_vec since 5.4 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0)
+#define skb_frag_off(frag) ((frag)->page_offset)
+#endif
+
+/* READ_ONCE came in 3.19 and WRITE_ONCE in 4.1, ACCESS_ONCE is gone since 4.15 */
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#endif
+#ifndef WRITE_ONCE
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
 
 #ifdef NET_IP_ALIGN
 #undef NET_IP_ALIGN
@@ -14,9 +42,47 @@ extern struct kvm_ivshmem_device ivs_info;
 
 netdev_tx_t nvoib_tx(struct sk_buff *skb, struct net_device *dev);
 int nvoib_rx(struct napi_struct *napi, int weight);
+#ifdef NVOIB_BUSY_POLL_NDO
+int nvoib_busy_poll(struct napi_struct *napi);
+#endif
 void nvoib_eth_addr(unsigned char *dev_addr);
-void nvoib_irq_enable(void);
-void nvoib_irq_disable(void);
+
+/*
+ * RX pages handed to the stack, oldest first. We keep one reference to
+ * each and take the page back for a ring slot once the skb is freed.
+ */
+struct nvoib_page_pool {
+	struct page *page[NVOIB_POOL_SIZE];
+	uint32_t head;
+	uint32_t count;
+};
+
+struct nvoib_queue {
+	int index;
+	void *shared_region;
+	struct napi_struct napi;
+
+	uint32_t tx_next;
+	uint32_t tx_clean;	/* oldest slot not yet reclaimed from the host */
+	uint32_t tx_kicked;	/* tx_next when the doorbell was last considered */
+	uint32_t rx_next;
+	uint32_t rx_avail;
+
+	/* skbs in flight, kept on the last slot of their chain */
+	struct sk_buff **tx_skb;
+
+	/* RX buffers of both ring formats */
+	struct page **rx_page;
+	struct nvoib_page_pool pool;
+
+#ifdef NVOIB_BUSY_POLL_NDO
+	spinlock_t poll_lock;
+	uint32_t poll_owner;
+#endif
+};
+
+void nvoib_irq_enable(struct nvoib_queue *queue);
+void nvoib_irq_disable(struct nvoib_queue *queue);
 
 struct kvm_ivshmem_device {
         void __iomem * regs;
@@ -27,29 +93,105 @@ struct kvm_ivshmem_device {
         char (*msix_names)[256];
         struct msix_entry *msix_entries;
         int nvectors;
-        void *shared_region;
+
+	struct nvoib_queue *queue;
+	int num_queues;
 
 	int mtu;
-	int ip_align;
+	int rx_headroom;		/* in front of the frame in an RX page */
+	unsigned int rx_order;
+	unsigned int rx_truesize;	/* PAGE_SIZE << rx_order */
+	int ring_format;
+	uint32_t ring_size;	/* entries in use, negotiated via RingSize */
+	uint32_t tx_chain_max;	/* longest chain one frame may take */
 };
 
 #define ENTRY_AVAILABLE 2
 #define ENTRY_INFLIGHT 1
 #define ENTRY_COMPLETE 0
 
+/* desc_flags of a TX descriptor, the host segments these frames */
+#define DESC_F_TSO4 0x0001
+#define DESC_F_TSO6 0x0002
+#define DESC_F_NEXT 0x0004	/* the frame continues in the next slot */
+
+#define DESC_CHAIN_MAX 18	/* slots of one frame: linear part + MAX_SKB_FRAGS */
+
 struct buf_data {
         volatile uint64_t       skb;
         volatile uint64_t       data_ptr;
         volatile uint32_t       size;
         volatile uint32_t       flag;
+        volatile uint16_t       desc_flags;
+        volatile uint16_t       gso_size;
+        volatile uint32_t       reserved;
 };
 
 struct ring_buf {
         struct buf_data buf[RING_SIZE];
-        volatile uint32_t       interruptible;
+        volatile uint32_t       event;		/* consumer: notify me at this slot */
+        volatile uint32_t       comp_event;	/* producer: notify me once this slot completes */
+        volatile uint32_t       busy_poll;	/* guest: bumped while a socket spins on RX */
+};
+
+/*
+ * RX interrupt coalescing, set through ethtool -C and applied by the
+ * host. Both ring formats end with this.
+ */
+#define NVOIB_COAL_USECS_MAX 1000
+
+struct ring_ctrl {
+	volatile uint32_t	coal_adaptive;	/* guest: the host picks the thresholds */
+	volatile uint32_t	coal_usecs;	/* guest: delay of the first completion */
+	volatile uint32_t	coal_frames;	/* guest: completions that cut it short */
+	volatile uint32_t	coal_cur_usecs;	/* host: thresholds in effect */
+	volatile uint32_t	coal_cur_frames;
 };
 
 struct shared_region {
 	struct ring_buf tx;
 	struct ring_buf rx;
+	struct ring_ctrl ctrl;
+};
+
+/*
+ * Split ring: descriptors are only read by the consumer and each side
+ * owns one index on its own cache line, so a handoff does not bounce
+ * the descriptor line. skb cookies live in nvoib_queue instead.
+ */
+#define RING_FORMAT_FLAG 0
+#define RING_FORMAT_SPLIT 1
+
+#define RING_CACHE_ALIGNED __attribute__((aligned(64)))
+
+struct ring_desc {
+	volatile uint64_t	data_ptr;
+	volatile uint32_t	size;
+	volatile uint16_t	desc_flags;
+	volatile uint16_t	gso_size;	/* TCP payload per segment */
+};
+
+struct split_ring {
+	volatile uint32_t	avail RING_CACHE_ALIGNED;	/* written by guest */
+	volatile uint32_t	used RING_CACHE_ALIGNED;	/* written by host */
+	volatile uint32_t	event RING_CACHE_ALIGNED;		/* written by consumer */
+	volatile uint32_t	comp_event RING_CACHE_ALIGNED;	/* written by producer */
+	volatile uint32_t	busy_poll RING_CACHE_ALIGNED;	/* written by guest, RX only */
+	struct ring_desc	desc[RING_SIZE] RING_CACHE_ALIGNED;
 };
+
+struct split_region {
+	struct split_ring	tx;
+	struct split_ring	rx;
+	struct ring_ctrl	ctrl RING_CACHE_ALIGNED;
+};
+
+struct ring_ctrl *nvoib_ctrl(struct nvoib_queue *queue);
+
+/*
+ * Event index: the consumer of a ring publishes the slot it waits for
+ * and the producer notifies only when a batch [old, new) covers it.
+ */
+static inline int nvoib_need_event(uint32_t size, uint32_t event, uint32_t new, uint32_t old){
+	return (new + size - event - 1) % size < (new + size - old) % size;
+}
@@ -15,7 +15,25 @@ static int netdev_down(struct net_device *dev);
 static void netdev_setup(struct net_device *dev);
 static void nvoib_net_mclist(struct net_device *dev);
 
-struct napi_struct napi;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+static int nvoib_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+	struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack);
+static int nvoib_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+	struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack);
+#else
+static int nvoib_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec);
+static int nvoib_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec);
+#endif
+
+static const struct ethtool_ops nvoib_ethtool_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS
+		| ETHTOOL_COALESCE_RX_MAX_FRAMES | ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+#endif
+	.get_link		= ethtool_op_get_link,
+	.get_coalesce		= nvoib_get_coalesce,
+	.set_coalesce		= nvoib_set_coalesce,
+};
 
 static const struct net_device_ops ip_netdev_ops = {
 //      .ndo_init       = ,			// Called at register_netdev
@@ -29,16 +47,69 @@ static const struct net_device_ops ip_netdev_ops = {
 	.ndo_set_rx_mode = nvoib_net_mclist,
 	.ndo_set_mac_address    = eth_mac_addr,
 	.ndo_validate_addr      = eth_validate_addr,
+#ifdef NVOIB_BUSY_POLL_NDO
+	.ndo_busy_poll		= nvoib_busy_poll,
+#endif
 };
 
 irqreturn_t nvoib_interrupt(int irq, void *dev){
+	struct nvoib_queue *queue = dev;
 	int ret = IRQ_HANDLED;
 
-	nvoib_irq_disable();
-	napi_schedule(&napi);
+	nvoib_irq_disable(queue);
+	napi_schedule(&queue->napi);
 	return ret;
 }
 
+/* queue 0 speaks for all of them, set_coalesce writes every queue alike */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+static int nvoib_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+	struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack){
+#else
+static int nvoib_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec){
+#endif
+	struct ring_ctrl *ctrl = nvoib_ctrl(&ivs_info.queue[0]);
+
+	ec->use_adaptive_rx_coalesce = ctrl->coal_adaptive;
+
+	/* adaptive thresholds are whatever the host settled on last */
+	if(ctrl->coal_adaptive){
+		ec->rx_coalesce_usecs = ctrl->coal_cur_usecs;
+		ec->rx_max_coalesced_frames = ctrl->coal_cur_frames;
+	}else{
+		ec->rx_coalesce_usecs = ctrl->coal_usecs;
+		ec->rx_max_coalesced_frames = ctrl->coal_frames;
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+static int nvoib_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+	struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack){
+#else
+static int nvoib_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec){
+#endif
+	struct ring_ctrl *ctrl;
+	int i;
+
+	if(ec->rx_coalesce_usecs > NVOIB_COAL_USECS_MAX
+	|| ec->rx_max_coalesced_frames > ivs_info.ring_size){
+		return -EINVAL;
+	}
+
+	/* the host picks the change up with its next rate sample */
+	for(i = 0; i < ivs_info.num_queues; i++){
+		ctrl = nvoib_ctrl(&ivs_info.queue[i]);
+		ctrl->coal_usecs = ec->rx_coalesce_usecs;
+		ctrl->coal_frames = ec->rx_max_coalesced_frames;
+		wmb();
+		ctrl->coal_adaptive = ec->use_adaptive_rx_coalesce;
+	}
+
+	return 0;
+}
+
 static void nvoib_net_mclist(struct net_device *dev){
 	/*
 	 * This callback is supposed to deal with mc filter in
@@ -49,20 +120,34 @@ static void nvoib_net_mclist(struct net_device *dev){
 }
 
 static int netdev_up(struct net_device *dev){
-	napi_enable(&napi);
-	netif_start_queue(dev);
-	nvoib_irq_enable();
+	int i;
+
+	for(i = 0; i < ivs_info.num_queues; i++){
+		napi_enable(&ivs_info.queue[i].napi);
+	}
+	netif_tx_start_all_queues(dev);
+	for(i = 0; i < ivs_info.num_queues; i++){
+		nvoib_irq_enable(&ivs_info.queue[i]);
+	}
 	return 0;
 }
 
 static int netdev_down(struct net_device *dev){
-	nvoib_irq_disable();
-	netif_stop_queue(dev);
+	int i;
+
+	for(i = 0; i < ivs_info.num_queues; i++){
+		nvoib_irq_disable(&ivs_info.queue[i]);
+	}
+	netif_tx_stop_all_queues(dev);
+	for(i = 0; i < ivs_info.num_queues; i++){
+		napi_disable(&ivs_info.queue[i].napi);
+	}
 	return 0;
 }
 
 static void netdev_setup(struct net_device *dev){
 	dev->netdev_ops = &ip_netdev_ops;
+	dev->ethtool_ops = &nvoib_ethtool_ops;
 	ether_setup(dev);
 	nvoib_eth_addr(dev->dev_addr);
 
@@ -76,22 +161,39 @@ static void netdev_setup(struct net_device *dev){
 */
 	dev->mtu = ivs_info.mtu - sizeof(struct ethhdr);
 	dev->tx_queue_len = 12800;
+
+	/* the host cuts TSO frames into IB MTU sends and fills in their checksums */
+	dev->hw_features = NETIF_F_SG | NETIF_F_IP_CSUM | NETIF_F_IPV6_CSUM
+		| NETIF_F_TSO | NETIF_F_TSO6;
+	dev->features |= dev->hw_features | NETIF_F_GSO | NETIF_F_GRO;
 }
 
 int netdev_create(struct net_device **dev){
 	int ret = 0;
+	int i;
 
-	*dev = alloc_netdev(0, NETDEV_NAME, netdev_setup);
+	*dev = alloc_netdev_mq(0, NETDEV_NAME, netdev_setup, ivs_info.num_queues);
 	if (!*dev) {
 		printk(KERN_ERR "IVSHMEM_NIC: Unable to allocate ip device.\n");
 		return -ENOMEM;
 	}
 
-	netif_napi_add(*dev, &napi, nvoib_rx, NAPI_POLL_WEIGHT);
+	for(i = 0; i < ivs_info.num_queues; i++){
+		netif_napi_add(*dev, &ivs_info.queue[i].napi, nvoib_rx, NAPI_POLL_WEIGHT);
+#ifdef NVOIB_BUSY_POLL_NDO
+		/* gives the napi an id that sockets record from our skbs */
+		napi_hash_add(&ivs_info.queue[i].napi);
+#endif
+	}
 
 	ret = register_netdev(*dev);
 	if(ret) {
 		printk(KERN_ERR "IVSHMEM_NIC: Unable to register ip device\n");
+#ifdef NVOIB_BUSY_POLL_NDO
+		for(i = 0; i < ivs_info.num_queues; i++){
+			napi_hash_del(&ivs_info.queue[i].napi);
+		}
+#endif
 		free_netdev(*dev);
 		return ret;
 	}
@@ -101,8 +203,18 @@ int netdev_create(struct net_device **dev){
 }
 
 void netdev_destroy(struct net_device *dev){
+#ifdef NVOIB_BUSY_POLL_NDO
+	int i;
+#endif
+
 	unregister_netdev(dev);
 
+#ifdef NVOIB_BUSY_POLL_NDO
+	for(i = 0; i < ivs_info.num_queues; i++){
+		napi_hash_del(&ivs_info.queue[i].napi);
+	}
+#endif
+
 	printk(KERN_INFO "IVSHMEM_NIC: Destroying rloc device.\n");
 }
 
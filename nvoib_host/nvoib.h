@@ -1,11 +1,22 @@
 #define MAX_EVENTS 16
-#define RING_SIZE 12800
+#define RING_SIZE 12800	/* largest ring, fixes the shared region layout */
 #define TX_POLL_INTERVAL 50000
 #define RX_POLL_INTERVAL 50000
 #define TX_POLL_RETRY 1000
 #define RX_POLL_RETRY 1000
 #define TX_POLL_BADGET 4096
-#define RX_POLL_BADGET 128
+#define WC_POLL_BADGET 32
+#define TX_SIGNAL_INTERVAL 16
+#define TX_INLINE_THRESHOLD 128
+#define DESC_CHAIN_MAX 18	/* TX slots of one frame: linear part + MAX_SKB_FRAGS */
+#define TX_SGE_MAX (DESC_CHAIN_MAX + 1)	/* rebuilt header + every fragment */
+#define TX_GSO_HDR_MAX 192	/* ethernet + IP + TCP headers with options */
+#define RX_SGE_MAX 2		/* GRH to the host, frame to the guest */
+
+/* wr_id of a send: WR sequence number << 32 | ring slot */
+#define TX_WR_SEQ(wr_id) ((uint32_t)((wr_id) >> 32))
+#define TX_WR_SLOT(wr_id) ((uint32_t)(wr_id) & ~TX_WR_NOSLOT)
+#define TX_WR_NOSLOT 0x80000000	/* leading segment, must not retire its slot */
 
 #define MCAST_BASE "ff05::"
 #define NVOIB_PORT 1
@@ -13,41 +24,270 @@
 #define RX_CPU_AFFINITY 2
 #define TX_CPU_AFFINITY 3
 
+#define NVOIB_MAX_QUEUES 16
+
+#define POLL_MODE_TIMER 0	/* timerfd driven polling after an event */
+#define POLL_MODE_HYBRID 1	/* spin, then fall back to POLL_MODE_TIMER */
+#define POLL_MODE_BUSY 2	/* spin forever on a dedicated core */
+
+#define POLL_SPIN_MIN 5000		/* ns */
+#define POLL_SPIN_MAX 200000		/* ns */
+#define POLL_BACKOFF_MAX 64		/* pause instructions per idle poll */
+#define POLL_EPOLL_INTERVAL 4096	/* spin rounds between non-blocking epoll checks */
+
 #define IS_ARP(buffer) \
 (((struct ethhdr *)(buffer))->h_proto == htons(ETH_P_ARP) ? 1 : 0)
 
 struct thread_param {
 	struct session *ss;
 	struct nvoib_dev *dev;
+	struct nvoib_queue *queue;
+};
+
+#define AH_CACHE_BUCKETS 256	/* power of 2 */
+#define AH_CACHE_TIMEOUT 60000000000ULL	/* ns an unreferenced AH is kept */
+
+struct ah_entry {
+	struct ibv_ah		*ah;
+	union ibv_gid		gid;
+	uint16_t		dlid;
+	uint8_t			sl;
+	uint32_t		refcnt;		/* forward entries using this AH */
+	uint64_t		idle_since;	/* ns, valid when refcnt is 0 */
+	struct ah_entry		*next;
+};
+
+struct ah_cache {
+	pthread_mutex_t		lock;
+	struct ibv_pd		*pd;
+	uint8_t			port_num;
+	struct ah_entry		*bucket[AH_CACHE_BUCKETS];
+	uint32_t		count;
+
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
 };
 
 struct forward_entry {
         struct ibv_ah   *ah;
         uint32_t        qpn;
+	struct ah_entry	*ahe;		/* reference held on ah, NULL if not cached */
+	volatile uint64_t seen;		/* ns of the last learn, for aging */
+	int		is_static;	/* set by the control plane, never aged */
+};
+
+/* control plane entry waiting for the session to come up */
+struct fdb_static {
+	uint8_t			mac[6];
+	uint16_t		lid;
+	union ibv_gid		gid;
+	uint32_t		qpn;
+	uint8_t			sl;
+	struct fdb_static	*next;
+};
+
+#define FDB_INIT_SIZE 64		/* slots, grows by doubling at 1/2 load */
+#define FDB_KEY_EMPTY 0
+#define FDB_READER_OFFLINE 0
+#define FDB_READERS (2 * NVOIB_MAX_QUEUES)	/* TX threads, then RX threads */
+#define FDB_RX_READER(index) (NVOIB_MAX_QUEUES + (index))
+#define FDB_RETIRE_ENTRY 0
+#define FDB_RETIRE_TABLE 1
+#define FDB_RETIRE_DELAY 1000000000	/* ns an AH outlives its last reader */
+#define FDB_AGING_TIME 300000000000ULL	/* ns a peer stays without being learned again */
+#define FDB_AGING_INTERVAL 1000000000	/* ns between aging sweeps */
+
+/* key is the 48-bit MAC with the tenant ID in the upper 16 bits */
+struct fdb_slot {
+	volatile uint64_t		key;
+	struct forward_entry * volatile	entry;
+};
+
+struct fdb_table {
+	uint32_t	mask;
+	uint32_t	used;		/* keys, aged ones stay as tombstones */
+	uint32_t	live;		/* keys with an entry */
+	struct fdb_slot	slot[];
+};
+
+struct fdb_reader {
+	volatile uint64_t	epoch;
+} __attribute__((aligned(64)));
+
+struct fdb_retired {
+	void			*ptr;
+	int			type;	/* FDB_RETIRE_* */
+	uint64_t		epoch;
+	uint64_t		time;
+	struct fdb_retired	*next;
 };
 
 struct forward_db {
-        struct forward_entry *entry[65536];
+	struct fdb_table * volatile	table;
+	struct forward_entry		*flood;		/* multicast group of the tenant */
+	uint16_t			tenant;
+
+	pthread_mutex_t			lock;		/* serializes writers */
+	volatile uint64_t		epoch;
+	struct fdb_reader		reader[FDB_READERS];
+	struct fdb_retired		*retired;
+
+	struct ah_cache			*ah_cache;
+	volatile uint64_t		next_age;	/* ns of the next aging sweep */
+	volatile uint64_t		clock;		/* ns of the last sweep, coarse time */
+};
+
+#define NEIGH_BUCKETS 1024	/* power of 2 */
+#define PROXY_FRAME_MAX 96	/* fits an ND advertisement with its option */
+#define PROXY_CHAIN_MAX 32	/* proxy replies per posted send chain */
+
+struct neigh_entry {
+	int			family;		/* AF_INET or AF_INET6 */
+	uint8_t			ip[16];
+	uint8_t			mac[6];
+	int			is_static;	/* preloaded, not overridden by snooping */
+	struct neigh_entry	*next;
+};
+
+struct neigh_table {
+	pthread_mutex_t		lock;
+	struct neigh_entry	*bucket[NEIGH_BUCKETS];
+	uint32_t		count;
+
+	uint64_t		replies;
+	uint64_t		misses;
 };
 
 struct forward_message {
 	struct forward_entry *entry;
-	uint16_t hash_key;
+	uint64_t key;
+};
+
+struct poll_state {
+	int		mode;
+	uint64_t	last_work;	/* ns timestamp of the last productive poll */
+	uint64_t	gap_avg;	/* EWMA of the gap between productive polls */
+	uint64_t	spin_budget;	/* ns to keep spinning after last_work */
+	uint64_t	rounds;		/* spin rounds, busy or idle */
+	uint32_t	backoff;
+};
+
+/*
+ * Interrupt moderation of one RX ring. Once the guest asks to be woken,
+ * the interrupt is held back until 'frames' completions or 'usecs' pass.
+ */
+#define COAL_WINDOW 1000000	/* ns of traffic behind one rate sample */
+#define COAL_PROFILES 5
+
+struct coal_state {
+	int		pending;	/* the guest waits, the interrupt is held back */
+	uint32_t	pending_frames;
+	uint64_t	deadline;	/* ns timestamp to interrupt at the latest */
+
+	uint32_t	usecs;		/* thresholds in effect */
+	uint32_t	frames;
+
+	uint64_t	window_start;	/* rate estimate, frames per second */
+	uint64_t	window_frames;
+	uint64_t	rate;
+	int		profile;
+};
+
+struct comp_stat {
+	uint64_t	polls;		/* ibv_poll_cq calls which returned completions */
+	uint64_t	wcs;		/* work completions harvested by them */
+};
+
+/* WRs of a ring scan are linked here and posted by one doorbell */
+struct send_chain {
+	struct ibv_send_wr	wr[TX_POLL_BADGET];
+	struct ibv_sge		sge[TX_POLL_BADGET][TX_SGE_MAX];
+	int			num;
+};
+
+struct recv_chain {
+	struct ibv_recv_wr	wr[TX_POLL_BADGET];
+	struct ibv_sge		sge[TX_POLL_BADGET][RX_SGE_MAX];
+	int			num;
+};
+
+/*
+ * Host side of an RX slot. The GRH is split off into here, so the frame
+ * lands at the guest's aligned skb->data. wr_id of a receive is the slot.
+ */
+struct rx_slot {
+	struct ibv_grh		grh;
+	uint8_t			*frame;
+};
+
+/* One TX/RX ring pair of the guest and the verbs resources serving it */
+struct nvoib_queue {
+	int			index;
+	int			ring_format;
+	uint32_t		ring_size;	/* entries in use, negotiated via RingSize */
+
+	int			rx_cpu;
+	int			tx_cpu;
+
+	void			*shared_region;
+	uint64_t		sr_guest_physical;
+
+	EventNotifier		rx_event;
+	EventNotifier		tx_event;
+	int			virq; /* KVM irqchip route for QEMU bypass */
+
+	uint32_t		next_tx_avail;
+	uint32_t		next_tx_comp;
+	uint32_t		next_rx_avail;
+	uint32_t		next_rx_comp;
+	uint32_t		rx_busy_seen;	/* busy_poll of the guest when last checked */
+	struct coal_state	rx_coal;
+
+	struct ibv_qp		*qp;
+
+	struct ibv_comp_channel	*rx_cc;
+	struct ibv_comp_channel	*tx_cc;
+
+	struct ibv_cq		*rx_cq;
+	struct ibv_cq		*tx_cq;
+
+	struct comp_stat	rx_stat;
+	struct comp_stat	tx_stat;
+
+	struct send_chain	*tx_chain;
+	struct recv_chain	*rx_chain;
+	struct rx_slot		*rx_slot;	/* ring_size entries */
+	struct ibv_mr		*rx_slot_mr;
+	uint32_t		tx_unsignaled;
+	uint32_t		tx_wr_seq;	/* send WRs requested so far */
+	uint32_t		tx_wr_done;	/* send WRs retired by completions */
+	uint32_t		tx_comp_seq;	/* last WR whose slots are behind next_tx_comp */
+	int			tx_blocked;	/* the send queue ran out of room */
+	uint64_t		tx_gso_dropped;	/* GSO frames we could not segment */
+	uint64_t		tx_sge_dropped;	/* chains too long to gather or copy */
+
+	uint8_t			*tx_hdr;	/* per WR headers of segmented frames */
+	uint32_t		tx_hdr_size;	/* room of one of them, a whole MTU if copies land there */
+	struct ibv_mr		*tx_hdr_mr;
+
+	struct learn_ring	*learn;		/* RX thread -> TX thread */
+	uint32_t		learn_tokens;	/* rate limit of rx_fdb_learn() */
+	uint64_t		learn_stamp;
+
+	uint8_t			*proxy_buf;	/* PROXY_CHAIN_MAX replies awaiting post */
+	uint32_t		proxy_used;
 };
 
 struct session {
         struct ibv_context      *ibverbs;
         struct ibv_pd           *pd;
-        struct ibv_qp           *qp;
         struct ibv_port_attr    portinfo;
+	uint8_t			port_num;
         struct forward_db       fdb;
-	mqd_t			mq_fd;
-
-        struct ibv_comp_channel *rx_cc;
-        struct ibv_comp_channel *tx_cc;
-
-        struct ibv_cq           *rx_cq;
-        struct ibv_cq           *tx_cq;
+	struct ah_cache		ah_cache;
+	struct neigh_table	neigh;
+	struct forward_entry	self;		/* loopback AH to our own QPs, read-only */
 
 	struct ibv_mr		*guest_memory_mr;
 };
@@ -56,53 +296,268 @@ struct session {
 #define ENTRY_INFLIGHT 1
 #define ENTRY_COMPLETE 0
 
+/* desc_flags of a TX descriptor */
+#define DESC_F_TSO4 0x0001	/* TCP/IPv4 frame to be cut into gso_size segments */
+#define DESC_F_TSO6 0x0002	/* TCP/IPv6 frame to be cut into gso_size segments */
+#define DESC_F_GSO (DESC_F_TSO4 | DESC_F_TSO6)
+#define DESC_F_NEXT 0x0004	/* the frame continues in the next slot */
+
+/* One slot of a TX descriptor chain, gathered before the send is built */
+struct tx_frag {
+	uint64_t		data_ptr;
+	uint32_t		size;
+};
+
+/* A large frame of the guest and how it is cut into UD sends */
+struct gso_frame {
+	uint16_t		desc_flags;
+	uint16_t		l3_off;		/* IP header */
+	uint16_t		l4_off;		/* TCP header */
+	uint16_t		hdr_len;	/* headers copied in front of each segment */
+	uint32_t		mss;
+	uint32_t		payload;
+	uint32_t		segs;
+};
+
 struct buf_data {
 	volatile uint64_t	skb;
 	volatile uint64_t	data_ptr;
 	volatile uint32_t	size;
 	volatile uint32_t	flag;
+	volatile uint16_t	desc_flags;
+	volatile uint16_t	gso_size;
+	volatile uint32_t	reserved;
 };
 
 struct ring_buf {
 	struct buf_data buf[RING_SIZE];
-	volatile uint32_t	interruptible;
+	volatile uint32_t	event;		/* consumer: notify me at this slot */
+	volatile uint32_t	comp_event;	/* producer: notify me once this slot completes */
+	volatile uint32_t	busy_poll;	/* guest: bumped while a socket spins on RX */
+};
+
+/*
+ * RX interrupt coalescing, set by the guest (ethtool -C) and read by
+ * the host whenever it is about to interrupt. Both ring formats end
+ * with this. Zeroes mean an interrupt for every batch.
+ */
+struct ring_ctrl {
+	volatile uint32_t	coal_adaptive;	/* guest: the host picks the thresholds */
+	volatile uint32_t	coal_usecs;	/* guest: delay of the first completion */
+	volatile uint32_t	coal_frames;	/* guest: completions that cut it short */
+	volatile uint32_t	coal_cur_usecs;	/* host: thresholds in effect */
+	volatile uint32_t	coal_cur_frames;
 };
 
 struct shared_region {
 	struct ring_buf	tx;		/* Guest chains TX buffer to 'tx' */
 	struct ring_buf rx;
+	struct ring_ctrl ctrl;
+};
+
+/*
+ * Split ring: descriptors are only read by the consumer and each side
+ * owns one index on its own cache line, so a handoff does not bounce
+ * the descriptor line. The guest keeps its skb cookies privately.
+ */
+#define RING_FORMAT_FLAG 0
+#define RING_FORMAT_SPLIT 1
+
+#define RING_CACHE_ALIGNED __attribute__((aligned(64)))
+
+struct ring_desc {
+	volatile uint64_t	data_ptr;
+	volatile uint32_t	size;
+	volatile uint16_t	desc_flags;
+	volatile uint16_t	gso_size;	/* TCP payload per segment */
 };
 
-typedef void (*comp_f)(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *);
+struct split_ring {
+	volatile uint32_t	avail RING_CACHE_ALIGNED;	/* written by guest */
+	volatile uint32_t	used RING_CACHE_ALIGNED;	/* written by host */
+	volatile uint32_t	event RING_CACHE_ALIGNED;		/* written by consumer */
+	volatile uint32_t	comp_event RING_CACHE_ALIGNED;	/* written by producer */
+	volatile uint32_t	busy_poll RING_CACHE_ALIGNED;	/* written by guest, RX only */
+	struct ring_desc	desc[RING_SIZE] RING_CACHE_ALIGNED;
+};
+
+struct split_region {
+	struct split_ring	tx;
+	struct split_ring	rx;
+	struct ring_ctrl	ctrl RING_CACHE_ALIGNED;
+};
+
+/*
+ * Learning channel from the RX thread of a queue to its TX thread.
+ * head and tail are free running, so head - tail is the fill level.
+ */
+#define LEARN_RING_SIZE 1024	/* power of 2 */
+#define LEARN_BADGET 64
+#define LEARN_BURST 64		/* learns a queue may issue back to back */
+#define LEARN_TOKEN_NS 10000	/* ns to earn one more learn */
+
+struct learn_ring {
+	volatile uint32_t	head RING_CACHE_ALIGNED;	/* written by RX */
+	volatile uint32_t	tail RING_CACHE_ALIGNED;	/* written by TX */
+	uint64_t		dropped;
+	struct forward_message	msg[LEARN_RING_SIZE] RING_CACHE_ALIGNED;
+};
+
+/*
+ * Event index: the consumer of a ring publishes the slot it waits for
+ * and the producer notifies only when a batch [old, new) covers it.
+ */
+static inline int ring_need_event(uint32_t size, uint32_t event, uint32_t new, uint32_t old){
+	return (new + size - event - 1) % size < (new + size - old) % size;
+}
+
+static inline volatile uint32_t *ring_tx_event(struct nvoib_queue *queue){
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->tx.event;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->tx.event;
+}
+
+static inline volatile uint32_t *ring_rx_event(struct nvoib_queue *queue){
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->rx.event;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->rx.event;
+}
+
+/* a guest socket spinning on the RX ring bumps this */
+static inline volatile uint32_t *ring_rx_busy(struct nvoib_queue *queue){
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->rx.busy_poll;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->rx.busy_poll;
+}
+
+static inline struct ring_ctrl *ring_ctrl(struct nvoib_queue *queue){
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->ctrl;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->ctrl;
+}
+
+/* the guest reclaims TX skbs from NAPI and sleeps on this slot */
+static inline volatile uint32_t *ring_tx_comp_event(struct nvoib_queue *queue){
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return &((struct split_region *)queue->shared_region)->tx.comp_event;
+	}
+
+	return &((struct shared_region *)queue->shared_region)->tx.comp_event;
+}
+
+typedef void (*comp_f)(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, int num);
 
 double gettimeofday_sec(void);
 
 /* Common methods (nvoib_common.c) */
-void nvoib_kick_enable(struct nvoib_dev *dev);
-void nvoib_kick_disable(struct nvoib_dev *dev);
+void nvoib_kick_enable(struct nvoib_queue *queue);
+void nvoib_kick_disable(struct nvoib_queue *queue);
 void nvoib_set_timer(int tm_fd, int interval);
 void nvoib_unset_timer(int tm_fd);
 void nvoib_epoll_add(int new_fd, int ep_fd);
 uint64_t nvoib_event_clear(int fd);
+void nvoib_set_affinity(int cpu);
+int nvoib_parse_cpus(const char *str, int *cpus, int max);
 
 /* Session related methods (nvoib_ss.c) */
 struct session *session_init(struct nvoib_dev *dev);
+uint32_t session_query_sge(struct nvoib_dev *dev);
 
 /* Completion queue related methods (nvoib_wc.c) */
+int comp_poll(struct session *ss, struct ibv_cq *cq,
+        struct nvoib_dev *dev, struct nvoib_queue *queue,
+	comp_f func, struct comp_stat *stat);
 void comp_pull(struct session *ss, struct ibv_comp_channel *cc,
-        struct nvoib_dev *dev, comp_f func);
-void comp_rx_work_completed(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *wc);
-void comp_tx_work_completed(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *wc);
+        struct nvoib_dev *dev, struct nvoib_queue *queue,
+	comp_f func, struct comp_stat *stat);
+double comp_average_batch(struct comp_stat *stat);
+void comp_rx_work_completed(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, int num);
+void comp_tx_work_completed(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, int num);
 void nvoib_request_recv(struct session *ss, struct nvoib_dev *dev,
-        uint64_t data_ptr, uint32_t size);
-void nvoib_request_send(struct session *ss, struct nvoib_dev *dev,
-        uint64_t data_ptr, uint32_t size);
+        struct nvoib_queue *queue, uint32_t index, uint64_t data_ptr, uint32_t size);
+int nvoib_request_send(struct session *ss, struct nvoib_dev *dev,
+        struct nvoib_queue *queue, uint32_t index, struct tx_frag *frag, int nfrags,
+	uint16_t desc_flags, uint16_t gso_size);
+void nvoib_post_recv(struct nvoib_queue *queue);
+void nvoib_post_send(struct nvoib_queue *queue);
+
+/* Segmentation offload related methods (nvoib_gso.c) */
+int gso_parse(struct gso_frame *gf, uint8_t *head, uint32_t head_len, uint32_t size,
+	uint16_t desc_flags, uint16_t gso_size, uint32_t mtu);
+uint64_t gso_csum_piece(uint64_t sum, const void *buf, uint32_t len, uint32_t pos);
+void gso_build(struct gso_frame *gf, uint8_t *head, uint8_t *hdr, uint32_t seg,
+	uint32_t len, uint64_t payload_sum);
 
 /* Ring buffer related methods (nvoib_ring.c) */
-void ring_tx_comp(struct nvoib_dev *dev);
-void ring_rx_comp(struct nvoib_dev *dev, uint32_t size, int badget);
-int ring_rx_avail(struct session *ss, struct nvoib_dev *dev);
-int ring_tx_avail(struct session *ss, struct nvoib_dev *dev, int badget);
+void ring_tx_comp(struct nvoib_queue *queue, uint32_t last, uint32_t seq);
+void ring_rx_comp(struct nvoib_queue *queue, uint32_t *size, int num);
+int ring_rx_avail(struct session *ss, struct nvoib_dev *dev, struct nvoib_queue *queue);
+int ring_tx_avail(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, int badget);
+
+/* Address handle cache related methods (nvoib_ah.c) */
+void ah_cache_init(struct ah_cache *cache, struct ibv_pd *pd, uint8_t port_num);
+struct ah_entry *ah_cache_get(struct ah_cache *cache, uint16_t dlid,
+	const union ibv_gid *gid, uint8_t sl);
+void ah_cache_put(struct ah_cache *cache, struct ah_entry *ahe);
+void ah_cache_age(struct ah_cache *cache, uint64_t now);
+
+/* Control plane related methods (nvoib_ctrl.c) */
+int ctrl_fdb_command(struct nvoib_dev *dev, const char *cmd, char **err);
+int ctrl_fdb_load(struct nvoib_dev *dev, const char *path);
+void ctrl_fdb_apply_pending(struct nvoib_dev *dev, struct session *ss);
+char *ctrl_fdb_dump(struct nvoib_dev *dev);
+
+/* Forwarding database related methods (nvoib_fdb.c) */
+void fdb_init(struct forward_db *fdb, uint16_t tenant, struct ah_cache *cache);
+uint64_t fdb_key(uint16_t tenant, const uint8_t *mac);
+struct forward_entry *fdb_lookup(struct forward_db *fdb, uint64_t key);
+void fdb_insert(struct forward_db *fdb, uint64_t key, struct forward_entry *entry);
+void fdb_age(struct forward_db *fdb);
+int fdb_delete(struct forward_db *fdb, uint64_t key);
+void fdb_foreach(struct forward_db *fdb,
+	void (*func)(uint64_t key, struct forward_entry *entry, void *opaque), void *opaque);
+void fdb_entry_free(struct forward_db *fdb, struct forward_entry *entry);
+void fdb_reader_online(struct forward_db *fdb, int reader);
+void fdb_reader_offline(struct forward_db *fdb, int reader);
+struct learn_ring *fdb_learn_alloc(void);
+int fdb_learn_push(struct learn_ring *ring, struct forward_message *message);
+int fdb_learn_drain(struct forward_db *fdb, struct learn_ring *ring, int badget);
+
+/* ARP/ND proxy related methods (nvoib_proxy.c) */
+void neigh_init(struct neigh_table *table);
+void neigh_learn(struct neigh_table *table, int family, const uint8_t *ip,
+	const uint8_t *mac, int is_static);
+int neigh_preload(struct neigh_table *table, const char *path);
+void proxy_snoop(struct neigh_table *table, void *frame, uint32_t size);
+uint32_t proxy_reply(struct neigh_table *table, void *frame, uint32_t size, void *reply);
+int proxy_is_self(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *wc);
+
+/* Interrupt coalescing related methods (nvoib_coal.c) */
+void coal_init(struct coal_state *cs);
+int coal_rx_comp(struct nvoib_queue *queue, int num, int wakeup, uint64_t now);
+int coal_rx_expired(struct nvoib_queue *queue, uint64_t now);
+void coal_rx_arm(struct nvoib_queue *queue, int co_fd, uint64_t now);
+
+/* Polling strategy related methods (nvoib_poll.c) */
+uint64_t poll_now(void);
+int poll_mode_parse(const char *str);
+void poll_state_init(struct poll_state *ps, int mode);
+void poll_state_work(struct poll_state *ps, uint64_t now);
+int poll_state_spin(struct poll_state *ps, uint64_t now);
+void poll_state_hold(struct poll_state *ps, uint64_t now);
+int poll_state_epoll(struct poll_state *ps);
 
 /* TX process related methods (nvoib_tx.c) */
 void *tx_wait(void *arg);
@@ -110,5 +565,7 @@ struct forward_entry *tx_fdb_lookup(struct forward_db *fdb, void *buffer);
 
 /* RX process related methods (nvoib_rx.c) */
 void *rx_wait(void *arg);
-void rx_fdb_learn(struct session *ss, struct ibv_wc *wc, void *buffer);
-
+void rx_fdb_check(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, struct rx_slot *slot);
+void rx_fdb_learn(struct session *ss, struct nvoib_queue *queue,
+	struct ibv_wc *wc, struct rx_slot *slot);
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+/*
+ * Address handles keyed by (DLID, SGID, SL) of the remote port. Every
+ * MAC behind the same port shares one handle, so learning a VM costs a
+ * hash lookup instead of a kernel call. Handles nobody references are
+ * kept for AH_CACHE_TIMEOUT in case the peer comes back.
+ */
+
+static inline uint32_t ah_cache_hash(uint16_t dlid, const union ibv_gid *gid, uint8_t sl){
+	uint64_t h;
+
+	h = gid->global.interface_id ^ ((uint64_t)dlid << 8) ^ sl;
+	return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) & (AH_CACHE_BUCKETS - 1);
+}
+
+void ah_cache_init(struct ah_cache *cache, struct ibv_pd *pd, uint8_t port_num){
+	memset(cache, 0, sizeof(struct ah_cache));
+
+	cache->pd = pd;
+	cache->port_num = port_num;
+	pthread_mutex_init(&cache->lock, NULL);
+	return;
+}
+
+struct ah_entry *ah_cache_get(struct ah_cache *cache, uint16_t dlid,
+	const union ibv_gid *gid, uint8_t sl){
+	struct ibv_ah_attr ah_attr;
+	struct ah_entry *ahe;
+	uint32_t bucket;
+
+	bucket = ah_cache_hash(dlid, gid, sl);
+
+	pthread_mutex_lock(&cache->lock);
+	for(ahe = cache->bucket[bucket]; ahe != NULL; ahe = ahe->next){
+		if(ahe->dlid == dlid && ahe->sl == sl
+		&& !memcmp(&ahe->gid, gid, sizeof(union ibv_gid))){
+			ahe->refcnt++;
+			cache->hits++;
+			goto out;
+		}
+	}
+
+	cache->misses++;
+
+	ahe = malloc(sizeof(struct ah_entry));
+	if(ahe == NULL){
+		goto out;
+	}
+
+	memset(&ah_attr, 0, sizeof(struct ibv_ah_attr));
+	ah_attr.is_global	= 1;
+	ah_attr.grh.dgid	= *gid;
+	ah_attr.dlid		= dlid;
+	ah_attr.sl		= sl;
+	ah_attr.port_num	= cache->port_num;
+
+	ahe->ah = ibv_create_ah(cache->pd, &ah_attr);
+	if(!ahe->ah){
+		printf("AH: failed to create ah\n");
+		free(ahe);
+		ahe = NULL;
+		goto out;
+	}
+
+	ahe->dlid	= dlid;
+	ahe->gid	= *gid;
+	ahe->sl		= sl;
+	ahe->refcnt	= 1;
+	ahe->idle_since	= 0;
+	ahe->next	= cache->bucket[bucket];
+	cache->bucket[bucket] = ahe;
+	cache->count++;
+
+	dprintf("AH: created ah (dlid = 0x%x, sl = %u)\n", dlid, sl);
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return ahe;
+}
+
+void ah_cache_put(struct ah_cache *cache, struct ah_entry *ahe){
+	pthread_mutex_lock(&cache->lock);
+	if(--ahe->refcnt == 0){
+		ahe->idle_since = poll_now();
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return;
+}
+
+void ah_cache_age(struct ah_cache *cache, uint64_t now){
+	struct ah_entry **pp, *ahe;
+	int i;
+
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < AH_CACHE_BUCKETS; i++){
+		pp = &cache->bucket[i];
+		while((ahe = *pp) != NULL){
+			/* released by another thread after 'now' was read */
+			if(ahe->refcnt != 0 || ahe->idle_since > now
+			|| now - ahe->idle_since < AH_CACHE_TIMEOUT){
+				pp = &ahe->next;
+				continue;
+			}
+
+			*pp = ahe->next;
+			ibv_destroy_ah(ahe->ah);
+			free(ahe);
+			cache->count--;
+			cache->evictions++;
+		}
+	}
+
+	dprintf("AH: %u cached (hits = %lu, misses = %lu, evictions = %lu)\n",
+		cache->count, cache->hits, cache->misses, cache->evictions);
+	pthread_mutex_unlock(&cache->lock);
+	return;
+}
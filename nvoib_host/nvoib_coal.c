@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+struct coal_profile {
+	uint64_t	rate;		/* frames per second this profile serves up to */
+	uint32_t	usecs;
+	uint32_t	frames;
+};
+
+/*
+ * Light traffic is request/response and wants every frame at once, bulk
+ * traffic fills the ring quickly and wants as few interrupts as possible.
+ */
+static const struct coal_profile coal_profiles[COAL_PROFILES] = {
+	{ 20000,	0,	1 },
+	{ 100000,	8,	16 },
+	{ 300000,	16,	32 },
+	{ 800000,	32,	64 },
+	{ UINT64_MAX,	64,	128 },
+};
+
+static void coal_rx_sample(struct nvoib_queue *queue, int num, uint64_t now);
+
+void coal_init(struct coal_state *cs){
+	memset(cs, 0, sizeof(struct coal_state));
+	cs->window_start = poll_now();
+	cs->frames = 1;
+}
+
+/*
+ * 'num' completions were just published and 'wakeup' tells whether the
+ * guest waits on one of them. Returns 1 when the guest is to be
+ * interrupted now.
+ */
+int coal_rx_comp(struct nvoib_queue *queue, int num, int wakeup, uint64_t now){
+	struct coal_state *cs = &queue->rx_coal;
+
+	coal_rx_sample(queue, num, now);
+
+	if(!wakeup && !cs->pending){
+		return 0;
+	}
+
+	if(!cs->pending){
+		cs->pending = 1;
+		cs->pending_frames = 0;
+		cs->deadline = now + (uint64_t)cs->usecs * 1000;
+	}
+
+	cs->pending_frames += num;
+	if(cs->pending_frames >= cs->frames || now >= cs->deadline){
+		cs->pending = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* the held back interrupt is due */
+int coal_rx_expired(struct nvoib_queue *queue, uint64_t now){
+	struct coal_state *cs = &queue->rx_coal;
+
+	if(!cs->pending || now < cs->deadline){
+		return 0;
+	}
+
+	cs->pending = 0;
+	return 1;
+}
+
+/* wake the RX thread at the deadline before it blocks */
+void coal_rx_arm(struct nvoib_queue *queue, int co_fd, uint64_t now){
+	struct coal_state *cs = &queue->rx_coal;
+	struct itimerspec val;
+	uint64_t wait;
+
+	if(!cs->pending){
+		return;
+	}
+
+	/* a zero it_value disarms the timer, never ask for that */
+	wait = cs->deadline > now ? cs->deadline - now : 1;
+
+	memset(&val, 0, sizeof(struct itimerspec));
+	val.it_value.tv_sec	= wait / 1000000000ULL;
+	val.it_value.tv_nsec	= wait % 1000000000ULL;
+
+	timerfd_settime(co_fd, 0, &val, NULL);
+	return;
+}
+
+/*
+ * Rate estimate behind the adaptive profile, an EWMA (1/4) of the frame
+ * rate over windows of COAL_WINDOW. A guest override is picked up here too.
+ */
+static void coal_rx_sample(struct nvoib_queue *queue, int num, uint64_t now){
+	struct coal_state *cs = &queue->rx_coal;
+	struct ring_ctrl *ctrl = ring_ctrl(queue);
+	uint64_t elapsed, rate;
+	int profile;
+
+	cs->window_frames += num;
+
+	elapsed = now - cs->window_start;
+	if(elapsed < COAL_WINDOW){
+		return;
+	}
+
+	rate = cs->window_frames * 1000000000ULL / elapsed;
+
+	/* after a quiet spell the old rate says nothing */
+	if(elapsed > 8 * COAL_WINDOW){
+		cs->rate = rate;
+	}else{
+		cs->rate = cs->rate - (cs->rate >> 2) + (rate >> 2);
+	}
+	cs->window_start = now;
+	cs->window_frames = 0;
+
+	if(ctrl->coal_adaptive){
+		for(profile = 0; cs->rate > coal_profiles[profile].rate; profile++);
+
+		if(profile != cs->profile){
+			dprintf("RX: coalescing profile %d -> %d (%lu frames/s)\n",
+				cs->profile, profile, cs->rate);
+		}
+
+		cs->profile = profile;
+		cs->usecs = coal_profiles[profile].usecs;
+		cs->frames = coal_profiles[profile].frames;
+	}else{
+		cs->usecs = ctrl->coal_usecs;
+		cs->frames = ctrl->coal_frames ? ctrl->coal_frames : 1;
+	}
+
+	/* let ethtool -c show what we made of it */
+	if(ctrl->coal_cur_usecs != cs->usecs || ctrl->coal_cur_frames != cs->frames){
+		ctrl->coal_cur_usecs = cs->usecs;
+		ctrl->coal_cur_frames = cs->frames;
+	}
+}
@@ -12,6 +12,7 @@
 #include <netinet/ether.h>
 #include <infiniband/verbs.h>
 #include <mqueue.h>
+#include <pthread.h>
 
 #include "debug.h"
 #include "nvoib_pci.h"
@@ -24,18 +25,17 @@ double gettimeofday_sec(void){
 	return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-void nvoib_kick_enable(struct nvoib_dev *dev){
-        struct shared_region *sr = dev->shared_region;
-
-        sr->tx.interruptible = 1;
-        return;
+void nvoib_kick_enable(struct nvoib_queue *queue){
+	/* ask for a kick when the guest fills the slot we stopped at */
+	*ring_tx_event(queue) = queue->next_tx_avail;
+	smp_mb();
+	return;
 }
 
-void nvoib_kick_disable(struct nvoib_dev *dev){
-        struct shared_region *sr = dev->shared_region;
-
-        sr->tx.interruptible = 0;
-        return;
+void nvoib_kick_disable(struct nvoib_queue *queue){
+	/* the guest can not reach the slot behind us without filling the ring */
+	*ring_tx_event(queue) = (queue->next_tx_avail + queue->ring_size - 1) % queue->ring_size;
+	return;
 }
 
 void nvoib_set_timer(int tm_fd, int interval){
@@ -86,3 +86,56 @@ uint64_t nvoib_event_clear(int fd){
 
         return val;
 }
+
+void nvoib_set_affinity(int cpu){
+	cpu_set_t cpu_mask;
+
+	/* wrap around so that many queues still land on existing cores */
+	cpu %= sysconf(_SC_NPROCESSORS_ONLN);
+
+	CPU_ZERO(&cpu_mask);
+	CPU_SET(cpu, &cpu_mask);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask) != 0){
+		printf("Failed to set CPU affinity\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return;
+}
+
+int nvoib_parse_cpus(const char *str, int *cpus, int max){
+	const char *p = str;
+	char *end;
+	long first, last;
+	int num = 0;
+
+	/* "2,4,6-9" style list as in taskset(1) */
+	while(*p != '\0' && num < max){
+		first = strtol(p, &end, 10);
+		if(end == p || first < 0){
+			return -1;
+		}
+
+		last = first;
+		if(*end == '-'){
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p || last < first){
+				return -1;
+			}
+		}
+
+		for(; first <= last && num < max; first++){
+			cpus[num++] = first;
+		}
+
+		if(*end == ','){
+			end++;
+		}else if(*end != '\0'){
+			return -1;
+		}
+		p = end;
+	}
+
+	return num;
+}
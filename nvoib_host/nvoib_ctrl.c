@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+/*
+ * Control plane for the fdb, reachable from QMP through the "fdb" QOM
+ * property of the device:
+ *
+ *   qom-set path=<dev> property=fdb value="add <mac> <lid> <gid> <qpn> [<sl>]; del <mac>"
+ *   qom-get path=<dev> property=fdb
+ *
+ * and from the command line through fdb_file, one "<mac> <lid> <gid>
+ * <qpn> [<sl>]" per line. These run in the QEMU main loop, so AH
+ * creation never stalls the poll threads. Entries given before the
+ * guest brings the device up are kept until session_init().
+ */
+
+static int ctrl_parse_static(const char *str, struct fdb_static *st){
+	char mac_str[32], gid_str[INET6_ADDRSTRLEN];
+	unsigned int lid, qpn, sl = 0;
+	struct ether_addr *mac;
+	int num;
+
+	num = sscanf(str, "%31s %i %45s %i %i", mac_str, &lid, gid_str, &qpn, &sl);
+	if(num < 4){
+		return -1;
+	}
+
+	mac = ether_aton(mac_str);
+	if(mac == NULL || lid > 0xffff || qpn > 0xffffff || sl > 15){
+		return -1;
+	}
+
+	if(inet_pton(AF_INET6, gid_str, st->gid.raw) != 1){
+		return -1;
+	}
+
+	memcpy(st->mac, mac->ether_addr_octet, ETH_ALEN);
+	st->lid = lid;
+	st->qpn = qpn;
+	st->sl = sl;
+	return 0;
+}
+
+static int ctrl_apply_static(struct session *ss, struct fdb_static *st){
+	struct forward_entry *entry;
+
+	entry = malloc(sizeof(struct forward_entry));
+	if(entry == NULL){
+		return -1;
+	}
+
+	entry->ahe = ah_cache_get(&ss->ah_cache, st->lid, &st->gid, st->sl);
+	if(entry->ahe == NULL){
+		free(entry);
+		return -1;
+	}
+
+	entry->ah = entry->ahe->ah;
+	entry->qpn = st->qpn;
+	entry->seen = poll_now();
+	entry->is_static = 1;
+
+	fdb_insert(&ss->fdb, fdb_key(ss->fdb.tenant, st->mac), entry);
+	return 0;
+}
+
+static int ctrl_add(struct nvoib_dev *dev, const char *args){
+	struct fdb_static *st;
+
+	st = malloc(sizeof(struct fdb_static));
+	if(st == NULL){
+		return -1;
+	}
+
+	if(ctrl_parse_static(args, st) < 0){
+		free(st);
+		return -1;
+	}
+
+	if(dev->ss != NULL){
+		int ret = ctrl_apply_static(dev->ss, st);
+
+		free(st);
+		return ret;
+	}
+
+	st->next = dev->fdb_pending;
+	dev->fdb_pending = st;
+	return 0;
+}
+
+static int ctrl_del(struct nvoib_dev *dev, const char *args){
+	struct fdb_static **pp, *st;
+	struct ether_addr *mac;
+	char mac_str[32];
+
+	if(sscanf(args, "%31s", mac_str) != 1 || (mac = ether_aton(mac_str)) == NULL){
+		return -1;
+	}
+
+	if(dev->ss != NULL){
+		return fdb_delete(&dev->ss->fdb,
+			fdb_key(dev->ss->fdb.tenant, mac->ether_addr_octet));
+	}
+
+	pp = &dev->fdb_pending;
+	while((st = *pp) != NULL){
+		if(!memcmp(st->mac, mac->ether_addr_octet, ETH_ALEN)){
+			*pp = st->next;
+			free(st);
+			return 0;
+		}
+		pp = &st->next;
+	}
+
+	return -1;
+}
+
+/* syntax of one command, the fdb is not touched */
+static int ctrl_check(const char *line){
+	struct fdb_static st;
+	char mac_str[32];
+
+	if(!strncmp(line, "add ", 4)){
+		return ctrl_parse_static(line + 4, &st);
+	}
+
+	if(!strncmp(line, "del ", 4)){
+		if(sscanf(line + 4, "%31s", mac_str) != 1 || ether_aton(mac_str) == NULL){
+			return -1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Bulk updates are checked as a whole before any of them is applied.
+ * Only a failure while applying, e.g. no AH or an unknown MAC to delete,
+ * leaves the commands before it in place; '*err' tells which one it was.
+ */
+int ctrl_fdb_command(struct nvoib_dev *dev, const char *cmd, char **err){
+	GPtrArray *lines;
+	char *buf, *line, *saveptr;
+	int i, ret = 0;
+
+	buf = strdup(cmd);
+	if(buf == NULL){
+		*err = g_strdup("out of memory");
+		return -1;
+	}
+	lines = g_ptr_array_new();
+
+	/* commands are separated by ';' or newlines */
+	for(line = strtok_r(buf, ";\n", &saveptr); line != NULL;
+	line = strtok_r(NULL, ";\n", &saveptr)){
+		while(*line == ' ' || *line == '\t'){
+			line++;
+		}
+
+		if(*line == '\0' || *line == '#'){
+			continue;
+		}
+
+		if(ctrl_check(line) < 0){
+			*err = g_strdup_printf("invalid fdb command \"%s\", nothing applied", line);
+			ret = -1;
+			goto out;
+		}
+		g_ptr_array_add(lines, line);
+	}
+
+	for(i = 0; i < lines->len; i++){
+		line = g_ptr_array_index(lines, i);
+
+		if(!strncmp(line, "add ", 4)){
+			ret = ctrl_add(dev, line + 4);
+		}else{
+			ret = ctrl_del(dev, line + 4);
+		}
+
+		if(ret < 0){
+			*err = g_strdup_printf("fdb command \"%s\" failed, the %d before it were applied",
+				line, i);
+			break;
+		}
+	}
+
+out:
+	if(ret < 0){
+		printf("CTRL: %s\n", *err);
+	}
+	g_ptr_array_free(lines, TRUE);
+	free(buf);
+	return ret;
+}
+
+int ctrl_fdb_load(struct nvoib_dev *dev, const char *path){
+	FILE *fp;
+	char line[256];
+	int num = 0;
+
+	fp = fopen(path, "r");
+	if(fp == NULL){
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), fp) != NULL){
+		if(line[0] == '#' || line[0] == '\n'){
+			continue;
+		}
+
+		if(ctrl_add(dev, line) < 0){
+			printf("CTRL: ignored invalid fdb entry: %s", line);
+			continue;
+		}
+		num++;
+	}
+
+	fclose(fp);
+	return num;
+}
+
+void ctrl_fdb_apply_pending(struct nvoib_dev *dev, struct session *ss){
+	struct fdb_static *st;
+
+	while((st = dev->fdb_pending) != NULL){
+		dev->fdb_pending = st->next;
+
+		if(ctrl_apply_static(ss, st) < 0){
+			printf("CTRL: failed to apply static fdb entry\n");
+		}
+		free(st);
+	}
+
+	return;
+}
+
+static void ctrl_fdb_dump_entry(uint64_t key, struct forward_entry *entry, void *opaque){
+	GString *out = opaque;
+	char gid_str[INET6_ADDRSTRLEN] = "-";
+
+	if(entry->ahe != NULL){
+		inet_ntop(AF_INET6, entry->ahe->gid.raw, gid_str, sizeof(gid_str));
+	}
+
+	g_string_append_printf(out, "%02x:%02x:%02x:%02x:%02x:%02x lid 0x%x gid %s qpn 0x%x %s\n",
+		(int)(key >> 40) & 0xff, (int)(key >> 32) & 0xff, (int)(key >> 24) & 0xff,
+		(int)(key >> 16) & 0xff, (int)(key >> 8) & 0xff, (int)key & 0xff,
+		entry->ahe != NULL ? entry->ahe->dlid : 0, gid_str, entry->qpn,
+		entry->is_static ? "static" : "learned");
+	return;
+}
+
+char *ctrl_fdb_dump(struct nvoib_dev *dev){
+	GString *out = g_string_new("");
+	struct fdb_static *st;
+	struct nvoib_queue *queue;
+	int i;
+
+	if(dev->ss == NULL){
+		for(st = dev->fdb_pending; st != NULL; st = st->next){
+			g_string_append_printf(out, "%s pending\n",
+				ether_ntoa((struct ether_addr *)st->mac));
+		}
+		return g_string_free(out, FALSE);
+	}
+
+	fdb_foreach(&dev->ss->fdb, ctrl_fdb_dump_entry, out);
+	g_string_append_printf(out, "# ah cache: %u cached, hits %lu, misses %lu, evictions %lu\n",
+		dev->ss->ah_cache.count, dev->ss->ah_cache.hits,
+		dev->ss->ah_cache.misses, dev->ss->ah_cache.evictions);
+
+	for(i = 0; i < dev->queues; i++){
+		queue = &dev->queue[i];
+		g_string_append_printf(out, "# queue %d: rx polls %lu, wcs %lu, batch %.2f;"
+			" tx polls %lu, wcs %lu, batch %.2f;"
+			" learn dropped %lu; gso dropped %lu; sge dropped %lu\n", i,
+			queue->rx_stat.polls, queue->rx_stat.wcs, comp_average_batch(&queue->rx_stat),
+			queue->tx_stat.polls, queue->tx_stat.wcs, comp_average_batch(&queue->tx_stat),
+			queue->learn != NULL ? queue->learn->dropped : 0, queue->tx_gso_dropped,
+			queue->tx_sge_dropped);
+	}
+
+	return g_string_free(out, FALSE);
+}
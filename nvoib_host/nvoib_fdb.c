@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+/*
+ * Open-addressing table with linear probing. Readers (the TX threads)
+ * never lock: a slot is published by writing its entry before its key,
+ * and anything a reader could still hold (replaced entries, tables left
+ * behind by a resize) is retired and only freed once every reader has
+ * passed a quiescent state or gone offline.
+ */
+
+static struct fdb_table *fdb_table_alloc(uint32_t size);
+static void fdb_table_put(struct fdb_table *table, uint64_t key,
+	struct forward_entry *entry);
+static void fdb_retire(struct forward_db *fdb, void *ptr, int type);
+static void fdb_reclaim(struct forward_db *fdb);
+
+static inline uint32_t fdb_hash(uint64_t key){
+	/* fibonacci hashing, the upper bits are the well mixed ones */
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+uint64_t fdb_key(uint16_t tenant, const uint8_t *mac){
+	uint64_t key = (uint64_t)tenant << 48;
+	int i;
+
+	for(i = 0; i < 6; i++){
+		key |= (uint64_t)mac[i] << (8 * (5 - i));
+	}
+
+	return key;
+}
+
+void fdb_init(struct forward_db *fdb, uint16_t tenant, struct ah_cache *cache){
+	memset(fdb, 0, sizeof(struct forward_db));
+
+	fdb->tenant = tenant;
+	fdb->ah_cache = cache;
+	fdb->clock = poll_now();
+	fdb->next_age = fdb->clock + FDB_AGING_INTERVAL;
+	fdb->epoch = 1;
+	fdb->table = fdb_table_alloc(FDB_INIT_SIZE);
+	pthread_mutex_init(&fdb->lock, NULL);
+	return;
+}
+
+static struct fdb_table *fdb_table_alloc(uint32_t size){
+	struct fdb_table *table;
+	size_t len = sizeof(struct fdb_table) + sizeof(struct fdb_slot) * size;
+
+	if(posix_memalign((void **)&table, 64, len) != 0){
+		printf("FDB: failed to allocate table\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(table, 0, len);
+	table->mask = size - 1;
+	return table;
+}
+
+struct forward_entry *fdb_lookup(struct forward_db *fdb, uint64_t key){
+	struct fdb_table *table;
+	struct forward_entry *entry;
+	uint64_t slot_key;
+	uint32_t i;
+
+	table = atomic_read(&fdb->table);
+	smp_rmb();
+	i = fdb_hash(key) & table->mask;
+
+	/* the load factor stays under 1/2, so an empty slot is always near */
+	while((slot_key = table->slot[i].key) != FDB_KEY_EMPTY){
+		if(slot_key == key){
+			smp_rmb();
+			entry = table->slot[i].entry;
+			return entry;
+		}
+		i = (i + 1) & table->mask;
+	}
+
+	return NULL;
+}
+
+static void fdb_table_put(struct fdb_table *table, uint64_t key,
+	struct forward_entry *entry){
+	uint32_t i = fdb_hash(key) & table->mask;
+
+	while(table->slot[i].key != FDB_KEY_EMPTY){
+		i = (i + 1) & table->mask;
+	}
+
+	table->slot[i].entry = entry;
+	smp_wmb();
+	table->slot[i].key = key;
+	table->used++;
+	table->live++;
+	return;
+}
+
+static void fdb_table_rebuild(struct forward_db *fdb, struct fdb_table *table,
+	uint64_t key, struct forward_entry *entry){
+	struct fdb_table *rebuilt;
+	uint32_t i, size = table->mask + 1;
+
+	/* tombstones are dropped, so a table full of aged peers does not grow */
+	if((table->live + 1) * 4 > size){
+		size *= 2;
+	}
+
+	rebuilt = fdb_table_alloc(size);
+	for(i = 0; i <= table->mask; i++){
+		if(table->slot[i].key != FDB_KEY_EMPTY && table->slot[i].entry != NULL){
+			fdb_table_put(rebuilt, table->slot[i].key, table->slot[i].entry);
+		}
+	}
+	fdb_table_put(rebuilt, key, entry);
+
+	smp_wmb();
+	atomic_set(&fdb->table, rebuilt);
+	fdb_retire(fdb, table, FDB_RETIRE_TABLE);
+	dprintf("FDB: table rebuilt with %u slots\n", rebuilt->mask + 1);
+	return;
+}
+
+void fdb_entry_free(struct forward_db *fdb, struct forward_entry *entry){
+	if(entry->ahe != NULL){
+		ah_cache_put(fdb->ah_cache, entry->ahe);
+	}else{
+		ibv_destroy_ah(entry->ah);
+	}
+
+	free(entry);
+	return;
+}
+
+void fdb_insert(struct forward_db *fdb, uint64_t key, struct forward_entry *entry){
+	struct fdb_table *table;
+	struct forward_entry *old;
+	uint32_t i;
+
+	if(key == FDB_KEY_EMPTY){
+		return;
+	}
+
+	pthread_mutex_lock(&fdb->lock);
+	table = fdb->table;
+
+	i = fdb_hash(key) & table->mask;
+	while(table->slot[i].key != FDB_KEY_EMPTY){
+		if(table->slot[i].key == key){
+			old = table->slot[i].entry;
+
+			/* what the control plane configured is not overridden by learning */
+			if(old != NULL && old->is_static && !entry->is_static){
+				fdb_entry_free(fdb, entry);
+				goto out;
+			}
+
+			/* the peer did not move, just keep it from aging out */
+			if(old != NULL && old->ah == entry->ah && old->qpn == entry->qpn){
+				old->seen = entry->seen;
+				fdb_entry_free(fdb, entry);
+				goto out;
+			}
+
+			/* the peer moved or was aged out: swap the entry in place */
+			smp_wmb();
+			atomic_set(&table->slot[i].entry, entry);
+			if(old != NULL){
+				fdb_retire(fdb, old, FDB_RETIRE_ENTRY);
+			}else{
+				table->live++;
+			}
+			goto out;
+		}
+		i = (i + 1) & table->mask;
+	}
+
+	if((table->used + 1) * 2 > table->mask + 1){
+		fdb_table_rebuild(fdb, table, key, entry);
+	}else{
+		fdb_table_put(table, key, entry);
+	}
+
+out:
+	fdb_reclaim(fdb);
+	pthread_mutex_unlock(&fdb->lock);
+	return;
+}
+
+static void fdb_retire(struct forward_db *fdb, void *ptr, int type){
+	struct fdb_retired *retired;
+
+	retired = malloc(sizeof(struct fdb_retired));
+	if(retired == NULL){
+		printf("FDB: failed to allocate retired node\n");
+		exit(EXIT_FAILURE);
+	}
+
+	retired->ptr	= ptr;
+	retired->type	= type;
+	retired->epoch	= fdb->epoch;
+	retired->time	= poll_now();
+	retired->next	= fdb->retired;
+	fdb->retired	= retired;
+
+	/* readers that announce the new epoch can no longer see ptr */
+	smp_mb();
+	atomic_set(&fdb->epoch, fdb->epoch + 1);
+	smp_mb();
+	return;
+}
+
+static void fdb_reclaim(struct forward_db *fdb){
+	struct fdb_retired **pp, *retired;
+	uint64_t oldest = fdb->epoch, epoch, now;
+	int i;
+
+	for(i = 0; i < FDB_READERS; i++){
+		epoch = atomic_read(&fdb->reader[i].epoch);
+		if(epoch != FDB_READER_OFFLINE && epoch < oldest){
+			oldest = epoch;
+		}
+	}
+
+	now = poll_now();
+	pp = &fdb->retired;
+	while((retired = *pp) != NULL){
+		/*
+		 * An AH may still be referenced by a posted but uncompleted
+		 * send after the reader moved on, so entries also age a bit.
+		 */
+		if(retired->epoch >= oldest
+		|| (retired->type == FDB_RETIRE_ENTRY && now - retired->time < FDB_RETIRE_DELAY)){
+			pp = &retired->next;
+			continue;
+		}
+
+		if(retired->type == FDB_RETIRE_ENTRY){
+			fdb_entry_free(fdb, retired->ptr);
+		}else{
+			free(retired->ptr);
+		}
+
+		*pp = retired->next;
+		free(retired);
+	}
+
+	return;
+}
+
+void fdb_age(struct forward_db *fdb){
+	struct fdb_table *table;
+	struct forward_entry *entry;
+	uint64_t now = poll_now();
+	uint32_t i;
+
+	/* cheap check for the poll loops, only one thread does the sweep */
+	if(now < atomic_read(&fdb->next_age) || pthread_mutex_trylock(&fdb->lock) != 0){
+		return;
+	}
+
+	fdb->next_age = now + FDB_AGING_INTERVAL;
+	atomic_set(&fdb->clock, now);
+	table = fdb->table;
+
+	for(i = 0; i <= table->mask; i++){
+		entry = table->slot[i].entry;
+
+		/* RX threads may have stamped an entry after 'now' was read */
+		if(entry == NULL || entry->is_static || entry->seen > now
+		|| now - entry->seen < FDB_AGING_TIME){
+			continue;
+		}
+
+		/* the key stays as a tombstone so that probe chains are not cut */
+		atomic_set(&table->slot[i].entry, NULL);
+		fdb_retire(fdb, entry, FDB_RETIRE_ENTRY);
+		table->live--;
+		dprintf("FDB: aged out 0x%012lx\n", table->slot[i].key & 0xffffffffffffULL);
+	}
+
+	fdb_reclaim(fdb);
+	pthread_mutex_unlock(&fdb->lock);
+
+	/* the reclaim above released handles later than 'now' */
+	ah_cache_age(fdb->ah_cache, poll_now());
+	return;
+}
+
+int fdb_delete(struct forward_db *fdb, uint64_t key){
+	struct fdb_table *table;
+	struct forward_entry *entry;
+	uint32_t i;
+	int ret = -1;
+
+	pthread_mutex_lock(&fdb->lock);
+	table = fdb->table;
+
+	i = fdb_hash(key) & table->mask;
+	while(table->slot[i].key != FDB_KEY_EMPTY){
+		if(table->slot[i].key == key){
+			entry = table->slot[i].entry;
+			if(entry != NULL){
+				atomic_set(&table->slot[i].entry, NULL);
+				fdb_retire(fdb, entry, FDB_RETIRE_ENTRY);
+				table->live--;
+				ret = 0;
+			}
+			break;
+		}
+		i = (i + 1) & table->mask;
+	}
+
+	fdb_reclaim(fdb);
+	pthread_mutex_unlock(&fdb->lock);
+	return ret;
+}
+
+void fdb_foreach(struct forward_db *fdb,
+	void (*func)(uint64_t key, struct forward_entry *entry, void *opaque), void *opaque){
+	struct fdb_table *table;
+	uint32_t i;
+
+	/* entries are only freed under the lock, so they stay valid here */
+	pthread_mutex_lock(&fdb->lock);
+	table = fdb->table;
+
+	for(i = 0; i <= table->mask; i++){
+		if(table->slot[i].key != FDB_KEY_EMPTY && table->slot[i].entry != NULL){
+			func(table->slot[i].key, table->slot[i].entry, opaque);
+		}
+	}
+
+	pthread_mutex_unlock(&fdb->lock);
+	return;
+}
+
+/* also serves as the quiescent state of a reader that stays online */
+void fdb_reader_online(struct forward_db *fdb, int reader){
+	atomic_set(&fdb->reader[reader].epoch, atomic_read(&fdb->epoch));
+	smp_mb();
+	return;
+}
+
+void fdb_reader_offline(struct forward_db *fdb, int reader){
+	smp_mb();
+	atomic_set(&fdb->reader[reader].epoch, FDB_READER_OFFLINE);
+	return;
+}
+
+struct learn_ring *fdb_learn_alloc(void){
+	struct learn_ring *ring;
+
+	if(posix_memalign((void **)&ring, 64, sizeof(struct learn_ring)) != 0){
+		printf("FDB: failed to allocate learning ring\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(ring, 0, sizeof(struct learn_ring));
+	return ring;
+}
+
+int fdb_learn_push(struct learn_ring *ring, struct forward_message *message){
+	uint32_t head = ring->head;
+
+	if(head - atomic_read(&ring->tail) == LEARN_RING_SIZE){
+		ring->dropped++;
+		return -1;
+	}
+
+	ring->msg[head & (LEARN_RING_SIZE - 1)] = *message;
+	smp_wmb();
+	atomic_set(&ring->head, head + 1);
+	return 0;
+}
+
+int fdb_learn_drain(struct forward_db *fdb, struct learn_ring *ring, int badget){
+	struct forward_message *message;
+	uint32_t head, tail = ring->tail;
+	int num = 0;
+
+	head = atomic_read(&ring->head);
+	if(head == tail){
+		return 0;
+	}
+	smp_rmb();
+
+	while(tail != head && num < badget){
+		message = &ring->msg[tail & (LEARN_RING_SIZE - 1)];
+		fdb_insert(fdb, message->key, message->entry);
+		tail++;
+		num++;
+	}
+
+	/* slots are copied out, hand them back to the producer */
+	smp_mb();
+	atomic_set(&ring->tail, tail);
+
+	dprintf("FDB: registered %d learned entries\n", num);
+	return num;
+}
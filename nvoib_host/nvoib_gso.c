@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/ether.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+#ifndef TH_CWR
+#define TH_CWR 0x80
+#endif
+
+static uint64_t gso_csum_add(uint64_t sum, const void *buf, uint32_t len);
+static uint16_t gso_csum_fold(uint64_t sum);
+static uint16_t gso_csum_fold16(uint64_t sum);
+
+/*
+ * Locate the headers of a TSO frame, which must all sit in its first slot.
+ * Anything we can not cut safely (non-TCP, IPv6 extension headers,
+ * oversized options) is refused.
+ */
+int gso_parse(struct gso_frame *gf, uint8_t *head, uint32_t head_len, uint32_t size,
+	uint16_t desc_flags, uint16_t gso_size, uint32_t mtu){
+	struct ethhdr *eth = (struct ethhdr *)head;
+	struct iphdr *ip4;
+	struct ip6_hdr *ip6;
+	struct tcphdr *tcp;
+
+	gf->desc_flags = desc_flags;
+	gf->l3_off = sizeof(struct ethhdr);
+
+	if(desc_flags & DESC_F_TSO4){
+		if(head_len < gf->l3_off + sizeof(struct iphdr)
+		|| eth->h_proto != htons(ETH_P_IP)){
+			return -1;
+		}
+
+		ip4 = (struct iphdr *)(head + gf->l3_off);
+		if(ip4->protocol != IPPROTO_TCP || ip4->ihl < 5){
+			return -1;
+		}
+		gf->l4_off = gf->l3_off + ip4->ihl * 4;
+	}else{
+		if(head_len < gf->l3_off + sizeof(struct ip6_hdr)
+		|| eth->h_proto != htons(ETH_P_IPV6)){
+			return -1;
+		}
+
+		ip6 = (struct ip6_hdr *)(head + gf->l3_off);
+		if(ip6->ip6_nxt != IPPROTO_TCP){
+			return -1;
+		}
+		gf->l4_off = gf->l3_off + sizeof(struct ip6_hdr);
+	}
+
+	if(head_len < gf->l4_off + sizeof(struct tcphdr)){
+		return -1;
+	}
+
+	tcp = (struct tcphdr *)(head + gf->l4_off);
+	gf->hdr_len = gf->l4_off + tcp->th_off * 4;
+	if(gf->hdr_len > TX_GSO_HDR_MAX || gf->hdr_len > head_len || gf->hdr_len >= size){
+		return -1;
+	}
+
+	/* the guest MTU keeps gso_size below the IB MTU, but do not rely on it */
+	gf->mss = gso_size;
+	if(gf->mss == 0 || gf->hdr_len + gf->mss > mtu){
+		gf->mss = mtu - gf->hdr_len;
+	}
+
+	gf->payload = size - gf->hdr_len;
+	gf->segs = (gf->payload + gf->mss - 1) / gf->mss;
+	return 0;
+}
+
+/*
+ * Payload of a segment may be spread over several slots. Add the piece
+ * found at byte 'pos' of the segment payload to a running checksum.
+ */
+uint64_t gso_csum_piece(uint64_t sum, const void *buf, uint32_t len, uint32_t pos){
+	uint64_t piece;
+
+	piece = gso_csum_add(0, buf, len);
+
+	/* an odd start swaps the byte lanes, the one's complement sum follows */
+	if(pos & 1){
+		piece = gso_csum_fold16(piece);
+		piece = ((piece & 0xff) << 8) | (piece >> 8);
+	}
+
+	return sum + piece;
+}
+
+/*
+ * Write the headers of segment 'seg', carrying 'len' payload bytes whose
+ * sum is 'payload_sum', to 'hdr'. The guest left the checksums to us.
+ */
+void gso_build(struct gso_frame *gf, uint8_t *head, uint8_t *hdr, uint32_t seg,
+	uint32_t len, uint64_t payload_sum){
+	struct iphdr *ip4;
+	struct ip6_hdr *ip6;
+	struct tcphdr *tcp;
+	uint32_t tcp_len;
+	uint64_t sum;
+
+	tcp_len = gf->hdr_len - gf->l4_off + len;
+
+	memcpy(hdr, head, gf->hdr_len);
+
+	tcp = (struct tcphdr *)(hdr + gf->l4_off);
+	tcp->th_seq = htonl(ntohl(tcp->th_seq) + seg * gf->mss);
+
+	/* CWR belongs to the first segment, FIN and PSH to the last one */
+	if(seg != 0){
+		tcp->th_flags &= ~TH_CWR;
+	}
+	if(seg != gf->segs - 1){
+		tcp->th_flags &= ~(TH_FIN | TH_PUSH);
+	}
+
+	if(gf->desc_flags & DESC_F_TSO4){
+		ip4 = (struct iphdr *)(hdr + gf->l3_off);
+		ip4->tot_len = htons(gf->hdr_len - gf->l3_off + len);
+		ip4->id = htons(ntohs(ip4->id) + seg);
+		ip4->check = 0;
+		ip4->check = gso_csum_fold(gso_csum_add(0, ip4, ip4->ihl * 4));
+
+		/* saddr and daddr are adjacent */
+		sum = gso_csum_add(0, &ip4->saddr, 2 * sizeof(struct in_addr));
+	}else{
+		ip6 = (struct ip6_hdr *)(hdr + gf->l3_off);
+		ip6->ip6_plen = htons(tcp_len);
+
+		sum = gso_csum_add(0, &ip6->ip6_src, 2 * sizeof(struct in6_addr));
+	}
+
+	sum += htons(IPPROTO_TCP);
+	sum += htons(tcp_len);
+
+	tcp->th_sum = 0;
+	sum = gso_csum_add(sum, tcp, gf->hdr_len - gf->l4_off);
+	tcp->th_sum = gso_csum_fold(sum + payload_sum);
+}
+
+/* one's complement sum of one piece in memory order */
+static uint64_t gso_csum_add(uint64_t sum, const void *buf, uint32_t len){
+	const uint8_t *p = buf;
+	uint8_t tail[2];
+	uint32_t word;
+	uint16_t half;
+
+	while(len >= sizeof(uint32_t)){
+		memcpy(&word, p, sizeof(uint32_t));
+		sum += word;
+		p += sizeof(uint32_t);
+		len -= sizeof(uint32_t);
+	}
+
+	if(len >= sizeof(uint16_t)){
+		memcpy(&half, p, sizeof(uint16_t));
+		sum += half;
+		p += sizeof(uint16_t);
+		len -= sizeof(uint16_t);
+	}
+
+	if(len){
+		tail[0] = *p;
+		tail[1] = 0;
+		memcpy(&half, tail, sizeof(uint16_t));
+		sum += half;
+	}
+
+	return sum;
+}
+
+static uint16_t gso_csum_fold16(uint64_t sum){
+	while(sum >> 16){
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return sum;
+}
+
+static uint16_t gso_csum_fold(uint64_t sum){
+	return ~gso_csum_fold16(sum);
+}
@@ -21,31 +21,66 @@
 #include "nvoib.h"
 
 static int pci_nvoib_thread(struct nvoib_dev *dev);
+static void pci_nvoib_set_cpus(struct nvoib_dev *dev);
 
 static void nvoib_io_write(void *opaque, hwaddr addr, uint64_t reg_val, unsigned size){
 	struct nvoib_dev *pci_dev = opaque;
+	struct nvoib_queue *queue = &pci_dev->queue[pci_dev->queue_sel];
 
 	addr &= 0xff;
 
 	switch (addr){
 		case Init:
 			if((reg_val & 0xffff) == 0){
-				nvoib_kick_enable(pci_dev);
 				pci_nvoib_thread(pci_dev);
 				dprintf("MAIN: Initialization request from guest\n");
 			}
 			break;
 
 		case SregionTop:
-			pci_dev->sr_guest_physical = 0;
-			((uint32_t *)&pci_dev->sr_guest_physical)[0] = (uint32_t)reg_val;
+			queue->sr_guest_physical = 0;
+			((uint32_t *)&queue->sr_guest_physical)[0] = (uint32_t)reg_val;
 			break;
 
 		case SregionBottom:
-			((uint32_t *)&pci_dev->sr_guest_physical)[1] = (uint32_t)reg_val;
-			pci_dev->shared_region =
-				(void *)(pci_dev->sr_guest_physical + (uint64_t)pci_dev->guest_memory);
-			dprintf("MAIN: shared_region = %p\n", (void *)pci_dev->sr_guest_physical);
+			((uint32_t *)&queue->sr_guest_physical)[1] = (uint32_t)reg_val;
+			queue->shared_region =
+				(void *)(queue->sr_guest_physical + (uint64_t)pci_dev->guest_memory);
+			dprintf("MAIN: shared_region[%d] = %p\n",
+				queue->index, (void *)queue->sr_guest_physical);
+			break;
+
+		case Queues:
+			if(reg_val < 1 || reg_val > pci_dev->max_queues){
+				printf("MAIN: guest requested invalid number of queues = %u\n",
+					(uint32_t)reg_val);
+				break;
+			}
+			pci_dev->queues = reg_val;
+			break;
+
+		case QueueSel:
+			if(reg_val < pci_dev->max_queues){
+				pci_dev->queue_sel = reg_val;
+			}
+			break;
+
+		case RingFormat:
+			if(reg_val != RING_FORMAT_FLAG && reg_val != RING_FORMAT_SPLIT){
+				printf("MAIN: guest requested unknown ring format = %u\n",
+					(uint32_t)reg_val);
+				break;
+			}
+			pci_dev->ring_format = reg_val;
+			break;
+
+		case RingSize:
+			if(reg_val < 2 || reg_val > pci_dev->ring_size){
+				printf("MAIN: guest requested invalid ring size = %u\n",
+					(uint32_t)reg_val);
+				break;
+			}
+			pci_dev->ring_entries = reg_val;
 			break;
 
 		default:
@@ -69,6 +104,19 @@ static uint64_t nvoib_io_read(void *opaque, hwaddr addr, unsigned size){
 			memcpy(&ret, &(dev->eth_addr->ether_addr_octet[3]), 3);
 			break;
 
+		case Queues:
+			ret = dev->max_queues;
+			break;
+
+		case RingSize:
+			ret = dev->ring_size;
+			break;
+
+		case ChainMax:
+			/* one SGE is kept for the header rebuilt by segmentation */
+			ret = MIN(DESC_CHAIN_MAX, MAX(dev->tx_sge - 1, 1));
+			break;
+
 		default:
 			dprintf("MAIN: Invalid MMIO read address = " TARGET_FMT_plx "\n", addr);
 			break;
@@ -89,14 +137,17 @@ static const MemoryRegionOps nvoib_mmio_ops = {
 
 static int nvoib_msix_vector_use(PCIDevice *pdev, unsigned int vector, MSIMessage msg){
 	struct nvoib_dev *dev;
+	struct nvoib_queue *queue;
 
 	dprintf("MAIN: nvoib_msix_vector_use called\n");
 	dev = NVOIB_DEV(pdev);
 	msix_vector_use(pdev, vector);
 
-	dev->virq = kvm_irqchip_add_msi_route(kvm_state, msg);
-	if(kvm_irqchip_add_irqfd_notifier(kvm_state, &dev->rx_event, dev->virq) < 0){
-		kvm_irqchip_release_virq(kvm_state, dev->virq);
+	/* vector N belongs to the RX ring of queue N */
+	queue = &dev->queue[vector];
+	queue->virq = kvm_irqchip_add_msi_route(kvm_state, msg);
+	if(kvm_irqchip_add_irqfd_notifier(kvm_state, &queue->rx_event, queue->virq) < 0){
+		kvm_irqchip_release_virq(kvm_state, queue->virq);
 	}
 
 	return 0;
@@ -104,13 +155,15 @@ static int nvoib_msix_vector_use(PCIDevice *pdev, unsigned int vector, MSIMessag
 
 static void nvoib_msix_vector_release(PCIDevice *pdev, unsigned int vector){
 	struct nvoib_dev *dev;
+	struct nvoib_queue *queue;
 
 	dprintf("MAIN: nvoib_msix_vector_release called\n");
 	dev = NVOIB_DEV(pdev);
 	msix_vector_unuse(pdev, vector);
 
-        kvm_irqchip_remove_irqfd_notifier(kvm_state, &dev->rx_event, dev->virq);
-        kvm_irqchip_release_virq(kvm_state, dev->virq);
+	queue = &dev->queue[vector];
+        kvm_irqchip_remove_irqfd_notifier(kvm_state, &queue->rx_event, queue->virq);
+        kvm_irqchip_release_virq(kvm_state, queue->virq);
 
 	return;
 }
@@ -175,35 +228,82 @@ static int pci_nvoib_thread(struct nvoib_dev *dev){
 	struct thread_param *param;
 	pthread_t rxwait_thread;
 	pthread_t txwait_thread;
-	char mq_path[256];
+	int i;
+
+	for(i = 0; i < dev->queues; i++){
+		if(dev->queue[i].shared_region == NULL){
+			printf("shared region %d is not initialized\n", i);
+			return -1;
+		}
 
-	if(dev->shared_region == NULL){
-		printf("shared region is not initialized\n");
-		return -1;
+		dev->queue[i].ring_format = dev->ring_format;
+		dev->queue[i].ring_size = dev->ring_entries;
+		nvoib_kick_enable(&dev->queue[i]);
 	}
 
 	ss = session_init(dev);
+	ctrl_fdb_apply_pending(dev, ss);
+	dev->ss = ss;
+
+	for(i = 0; i < dev->queues; i++){
+		param = malloc(sizeof(struct thread_param));
+		param->ss	= ss;
+		param->dev	= dev;
+		param->queue	= &dev->queue[i];
+
+		if(pthread_create(&rxwait_thread, NULL, rx_wait, param) != 0){
+			return -1;
+		}
+		printf("MAIN: RX waiting thread %d created\n", i);
+
+		if(pthread_create(&txwait_thread, NULL, tx_wait, param) != 0){
+			return -1;
+		}
+		printf("MAIN: TX waiting thread %d created\n", i);
+	}
 
-	sprintf(mq_path, "/%s", dev->eth_addr_str);
-	mq_unlink(mq_path);
-	ss->mq_fd = mq_open(mq_path, O_RDWR | O_CREAT, S_IRWXU | S_IRWXO, NULL);
-	dprintf("MAIN: mq_fd = %d, mq_path = %s\n", (int)ss->mq_fd, mq_path);
+	return 0;
+}
 
-        param = malloc(sizeof(struct thread_param));
-        param->ss	= ss;
-        param->dev	= dev;
+static void pci_nvoib_set_cpus(struct nvoib_dev *dev){
+	int rx_cpus[NVOIB_MAX_QUEUES], tx_cpus[NVOIB_MAX_QUEUES];
+	int rx_num = 0, tx_num = 0, i;
 
-	if(pthread_create(&rxwait_thread, NULL, rx_wait, param) != 0){
-		return -1;
+	if(dev->rx_cpus_str != NULL){
+		rx_num = nvoib_parse_cpus(dev->rx_cpus_str, rx_cpus, NVOIB_MAX_QUEUES);
 	}
-	printf("MAIN: RX waiting thread created\n");
 
-        if(pthread_create(&txwait_thread, NULL, tx_wait, param) != 0){
-                return -1;
-        }
-	printf("MAIN: TX waiting thread created\n");
+	if(dev->tx_cpus_str != NULL){
+		tx_num = nvoib_parse_cpus(dev->tx_cpus_str, tx_cpus, NVOIB_MAX_QUEUES);
+	}
 
-	return 0;
+	if(rx_num < 0 || tx_num < 0){
+		printf("MAIN: could not parse rx_cpus/tx_cpus\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* queues beyond the end of a list wrap around to its head */
+	for(i = 0; i < dev->max_queues; i++){
+		dev->queue[i].rx_cpu = rx_num ?
+			rx_cpus[i % rx_num] : RX_CPU_AFFINITY + 2 * i;
+		dev->queue[i].tx_cpu = tx_num ?
+			tx_cpus[i % tx_num] : TX_CPU_AFFINITY + 2 * i;
+	}
+
+	return;
+}
+
+static char *pci_nvoib_get_fdb(Object *obj, Error **errp){
+	return ctrl_fdb_dump(NVOIB_DEV(obj));
+}
+
+static void pci_nvoib_set_fdb(Object *obj, const char *value, Error **errp){
+	char *err;
+
+	if(ctrl_fdb_command(NVOIB_DEV(obj), value, &err) < 0){
+		error_setg(errp, "nvoib: %s", err);
+		g_free(err);
+	}
 }
 
 static void pci_nvoib_set_memory(void *host_addr, ram_addr_t offset, ram_addr_t length, void *opaque){
@@ -218,6 +318,7 @@ static void pci_nvoib_set_memory(void *host_addr, ram_addr_t offset, ram_addr_t
 static int pci_nvoib_init(PCIDevice *pdev){
 	struct nvoib_dev *dev = NVOIB_DEV(pdev);
 	uint8_t *pci_conf;
+	int i;
 
 	register_savevm(DEVICE(pdev), "nvoib_dev", 0, 0, nvoib_save, nvoib_load, pdev);
 
@@ -232,8 +333,81 @@ static int pci_nvoib_init(PCIDevice *pdev){
 	/* region for registers*/
 	pci_register_bar(pdev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &dev->nvoib_mmio);
 
-	dev->shared_region = NULL;
-	dev->rx_remain = 0;
+	if(dev->max_queues < 1 || dev->max_queues > NVOIB_MAX_QUEUES){
+		printf("MAIN: queues must be between 1 and %d\n", NVOIB_MAX_QUEUES);
+		exit(EXIT_FAILURE);
+	}
+
+	dev->queue = malloc(sizeof(struct nvoib_queue) * dev->max_queues);
+	if(dev->queue == NULL){
+		printf("MAIN: could not allocate queues\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(dev->queue, 0, sizeof(struct nvoib_queue) * dev->max_queues);
+
+	for(i = 0; i < dev->max_queues; i++){
+		dev->queue[i].index = i;
+	}
+
+	/* single queue until the guest asks for more */
+	dev->queues = 1;
+	dev->queue_sel = 0;
+	dev->ring_format = RING_FORMAT_FLAG;
+
+	if(dev->ring_size < 2 || dev->ring_size > RING_SIZE){
+		printf("MAIN: ring_size must be between 2 and %d\n", RING_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	/* guests unaware of RingSize use the whole offer */
+	dev->ring_entries = dev->ring_size;
+
+	if(dev->rx_interval == 0 || dev->rx_interval >= 1000000000
+	|| dev->tx_interval == 0 || dev->tx_interval >= 1000000000){
+		printf("MAIN: rx_interval/tx_interval must be between 1 and 999999999 ns\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(dev->tx_badget == 0 || dev->tx_badget > TX_POLL_BADGET){
+		printf("MAIN: tx_badget must be between 1 and %d\n", TX_POLL_BADGET);
+		exit(EXIT_FAILURE);
+	}
+
+	if(dev->hca_port < 1 || dev->hca_port > 255){
+		printf("MAIN: invalid port = %u\n", dev->hca_port);
+		exit(EXIT_FAILURE);
+	}
+
+	/* the guest reads its chain limit before any session exists */
+	dev->tx_sge = session_query_sge(dev);
+	if(dev->tx_sge < TX_SGE_MAX){
+		printf("MAIN: HCA gathers %u SGEs, longer TX chains are copied\n", dev->tx_sge);
+	}
+
+	pci_nvoib_set_cpus(dev);
+
+	if(dev->fdb_file != NULL){
+		int num = ctrl_fdb_load(dev, dev->fdb_file);
+
+		if(num < 0){
+			printf("MAIN: could not open fdb_file %s\n", dev->fdb_file);
+			exit(EXIT_FAILURE);
+		}
+		printf("MAIN: loaded %d static fdb entries\n", num);
+	}
+
+	/* fdb control plane for qom-set/qom-get over QMP */
+	object_property_add_str(OBJECT(dev), "fdb", pci_nvoib_get_fdb, pci_nvoib_set_fdb, NULL);
+
+	if(dev->tx_signal == 0){
+		dev->tx_signal = 1;
+	}
+
+	dev->poll_mode = poll_mode_parse(dev->poll_mode_str);
+	if(dev->poll_mode < 0){
+		printf("MAIN: poll must be one of timer, hybrid or busy\n");
+		exit(EXIT_FAILURE);
+	}
 
 	dev->eth_addr = ether_aton((const char *)dev->eth_addr_str);
 	if(dev->eth_addr == NULL){
@@ -250,19 +424,24 @@ static int pci_nvoib_init(PCIDevice *pdev){
 	printf("MAIN: guest physical 0x0 is host virtual %p, size = %llu\n",
 		dev->guest_memory, (long long unsigned)dev->ram_size);
 
-        if(event_notifier_init(&dev->tx_event, 0)){
-                printf("MAIN: could not init event_notifier\n");
-		exit(EXIT_FAILURE);
-        }
+	for(i = 0; i < dev->max_queues; i++){
+		struct nvoib_queue *queue = &dev->queue[i];
 
-	memory_region_add_eventfd(&dev->nvoib_mmio, Doorbell, 4, false, 0, &dev->tx_event);
+		if(event_notifier_init(&queue->tx_event, 0)){
+			printf("MAIN: could not init event_notifier\n");
+			exit(EXIT_FAILURE);
+		}
 
-	if(event_notifier_init(&dev->rx_event, 0)){
-		printf("MAIN: could not init event_notifier\n");
-		exit(EXIT_FAILURE);
+		/* guest writes the queue index to the doorbell */
+		memory_region_add_eventfd(&dev->nvoib_mmio, Doorbell, 4, true, i, &queue->tx_event);
+
+		if(event_notifier_init(&queue->rx_event, 0)){
+			printf("MAIN: could not init event_notifier\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	dev->vectors = 1; /* currently only 1 msix vector is used */
+	dev->vectors = dev->max_queues; /* one msix vector per RX ring */
 	nvoib_enable_msix(pdev);
 	pdev->config_write = pci_default_write_config;
 
@@ -271,8 +450,11 @@ static int pci_nvoib_init(PCIDevice *pdev){
 
 static void pci_nvoib_uninit(PCIDevice *dev){
 	struct nvoib_dev *s = NVOIB_DEV(dev);
+	int i;
 
-	event_notifier_cleanup(&s->rx_event);
+	for(i = 0; i < s->max_queues; i++){
+		event_notifier_cleanup(&s->queue[i].rx_event);
+	}
 
 	memory_region_destroy(&s->nvoib_mmio);
 	unregister_savevm(DEVICE(dev), "nvoib_dev", s);
@@ -281,6 +463,23 @@ static void pci_nvoib_uninit(PCIDevice *dev){
 static Property nvoib_properties[] = {
 	DEFINE_PROP_HEX32("tenant", struct nvoib_dev, tenant_id, 1),
 	DEFINE_PROP_STRING("ethaddr", struct nvoib_dev, eth_addr_str),
+	DEFINE_PROP_UINT32("queues", struct nvoib_dev, max_queues, 1),
+	DEFINE_PROP_STRING("poll", struct nvoib_dev, poll_mode_str),
+	DEFINE_PROP_UINT32("tx_signal", struct nvoib_dev, tx_signal, TX_SIGNAL_INTERVAL),
+	DEFINE_PROP_UINT32("tx_inline", struct nvoib_dev, tx_inline, TX_INLINE_THRESHOLD),
+	DEFINE_PROP_UINT32("ring_size", struct nvoib_dev, ring_size, RING_SIZE),
+	DEFINE_PROP_UINT32("rx_interval", struct nvoib_dev, rx_interval, RX_POLL_INTERVAL),
+	DEFINE_PROP_UINT32("tx_interval", struct nvoib_dev, tx_interval, TX_POLL_INTERVAL),
+	DEFINE_PROP_UINT32("rx_retry", struct nvoib_dev, rx_retry, RX_POLL_RETRY),
+	DEFINE_PROP_UINT32("tx_retry", struct nvoib_dev, tx_retry, TX_POLL_RETRY),
+	DEFINE_PROP_UINT32("tx_badget", struct nvoib_dev, tx_badget, TX_POLL_BADGET),
+	DEFINE_PROP_STRING("rx_cpus", struct nvoib_dev, rx_cpus_str),
+	DEFINE_PROP_STRING("tx_cpus", struct nvoib_dev, tx_cpus_str),
+	DEFINE_PROP_UINT32("arp_proxy", struct nvoib_dev, arp_proxy, 0),
+	DEFINE_PROP_STRING("neigh_file", struct nvoib_dev, neigh_file),
+	DEFINE_PROP_STRING("fdb_file", struct nvoib_dev, fdb_file),
+	DEFINE_PROP_STRING("hca", struct nvoib_dev, hca_name),
+	DEFINE_PROP_UINT32("port", struct nvoib_dev, hca_port, NVOIB_PORT),
 	DEFINE_PROP_END_OF_LIST(),
 };
 
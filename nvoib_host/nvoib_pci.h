@@ -13,23 +13,43 @@ struct nvoib_dev {
 
 	MemoryRegion		nvoib_mmio;
 
-	EventNotifier		rx_event;
-	EventNotifier		tx_event;
+	struct nvoib_queue	*queue;
+	uint32_t		queues;		/* ring pairs activated by the guest */
+	uint32_t		max_queues;	/* ring pairs offered to the guest */
+	uint32_t		queue_sel;	/* target of SregionTop/Bottom */
+	uint32_t		ring_format;	/* RING_FORMAT_* chosen by the guest */
+	uint32_t		ring_size;	/* ring entries offered to the guest */
+	uint32_t		ring_entries;	/* ring entries accepted by the guest */
 
-	int			rx_remain;
-
-	void			*shared_region;
-	uint64_t		sr_guest_physical;
 	uint32_t		vectors;
 	uint32_t		tenant_id;
+	uint32_t		tx_signal;	/* signal every Nth send */
+	uint32_t		tx_inline;	/* inline sends up to this size */
+	uint32_t		tx_sge;		/* SGEs the HCA gathers for one send */
+	char			*poll_mode_str;
+	int			poll_mode;	/* POLL_MODE_* of the poll threads */
+	uint32_t		rx_interval;	/* ns between RX polls */
+	uint32_t		tx_interval;	/* ns between TX polls */
+	uint32_t		rx_retry;	/* empty polls before RX sleeps */
+	uint32_t		tx_retry;	/* empty polls before TX sleeps */
+	uint32_t		tx_badget;	/* TX slots taken per poll */
+	char			*rx_cpus_str;
+	char			*tx_cpus_str;
+
+	uint32_t		arp_proxy;	/* answer ARP/ND from the neighbor table */
+	char			*neigh_file;	/* "<ip> <mac>" lines preloaded into it */
+
+	char			*fdb_file;	/* static fdb entries loaded at startup */
+	struct fdb_static	*fdb_pending;	/* static entries until the session exists */
+	struct session		*ss;
+
+	char			*hca_name;	/* ibverbs device, first one if NULL */
+	uint32_t		hca_port;
 	void			*guest_memory;
 	uint64_t		ram_size;
 
 	char			*eth_addr_str;
 	struct ether_addr	*eth_addr;
-
-	/* EXPERIMENTAL */
-	int			virq; /* KVM irqchip route for QEMU bypass */
 };
 
 /* registers for the Inter-VM shared memory device */
@@ -41,5 +61,10 @@ enum nvoib_registers {
 	SregionBottom	= 0x0c,		/* Bottom-half of shared region */
 	EthaddrTop	= 0x10,		/* Top-half of ether address */
 	EthaddrBottom	= 0x14,		/* Bottom-half of ether address */
+	Queues		= 0x18,		/* Number of ring pairs */
+	QueueSel	= 0x1c,		/* Ring pair selected by Sregion* */
+	RingFormat	= 0x20,		/* Ring protocol used by the guest */
+	RingSize	= 0x24,		/* Ring entries offered/accepted */
+	ChainMax	= 0x28,		/* TX slots one frame may take */
 };
 
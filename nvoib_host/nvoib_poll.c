@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+static inline void poll_cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+uint64_t poll_now(void){
+	struct timespec ts;
+
+	/* served by the vDSO, so spinning threads stay out of the kernel */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int poll_mode_parse(const char *str){
+	if(str == NULL || !strcmp(str, "timer")){
+		return POLL_MODE_TIMER;
+	}else if(!strcmp(str, "hybrid")){
+		return POLL_MODE_HYBRID;
+	}else if(!strcmp(str, "busy")){
+		return POLL_MODE_BUSY;
+	}
+
+	return -1;
+}
+
+void poll_state_init(struct poll_state *ps, int mode){
+	memset(ps, 0, sizeof(struct poll_state));
+	ps->mode	= mode;
+	ps->last_work	= poll_now();
+	ps->spin_budget	= POLL_SPIN_MAX;
+	ps->backoff	= 1;
+}
+
+void poll_state_work(struct poll_state *ps, uint64_t now){
+	uint64_t gap = now - ps->last_work;
+
+	/* EWMA (1/8) of the gap between polls that found work */
+	ps->gap_avg = ps->gap_avg - (ps->gap_avg >> 3) + (gap >> 3);
+	ps->last_work = now;
+	ps->backoff = 1;
+
+	/* spinning across gaps longer than the cap only burns the core */
+	if(ps->gap_avg > POLL_SPIN_MAX){
+		ps->spin_budget = POLL_SPIN_MIN;
+	}else{
+		ps->spin_budget = ps->gap_avg * 2;
+		if(ps->spin_budget < POLL_SPIN_MIN){
+			ps->spin_budget = POLL_SPIN_MIN;
+		}else if(ps->spin_budget > POLL_SPIN_MAX){
+			ps->spin_budget = POLL_SPIN_MAX;
+		}
+	}
+}
+
+/* keep spinning for another budget, without counting it as work */
+void poll_state_hold(struct poll_state *ps, uint64_t now){
+	ps->last_work = now;
+}
+
+int poll_state_spin(struct poll_state *ps, uint64_t now){
+	uint32_t i;
+
+	if(ps->mode != POLL_MODE_BUSY && now - ps->last_work > ps->spin_budget){
+		return 0;
+	}
+
+	/* back off exponentially while idle to leave the sibling thread some room */
+	for(i = 0; i < ps->backoff; i++){
+		poll_cpu_relax();
+	}
+	if(ps->backoff < POLL_BACKOFF_MAX){
+		ps->backoff <<= 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Channel events are serviced on a fixed period of spin rounds, also
+ * while every round finds work, so nothing behind epoll starves.
+ */
+int poll_state_epoll(struct poll_state *ps){
+	return !(++ps->rounds % POLL_EPOLL_INTERVAL);
+}
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <infiniband/verbs.h>
+#include <mqueue.h>
+
+#include "debug.h"
+#include "nvoib_pci.h"
+#include "nvoib.h"
+
+/*
+ * ARP/ND proxy: requests of the guest whose target is in the neighbor
+ * table are answered by the host and never reach the multicast group.
+ * The reply is sent to our own QP, so it enters the guest through the
+ * ordinary RX path. The table is fed by snooping received ARP and ND
+ * and by the neigh_file preload.
+ */
+
+struct proxy_ns {
+	struct ethhdr			eth;
+	struct ip6_hdr			ip6;
+	struct nd_neighbor_solicit	ns;
+} __attribute__((packed));
+
+struct proxy_na {
+	struct ethhdr			eth;
+	struct ip6_hdr			ip6;
+	struct nd_neighbor_advert	na;
+	struct nd_opt_hdr		opt;
+	uint8_t				lladdr[ETH_ALEN];
+} __attribute__((packed));
+
+struct proxy_arp {
+	struct ethhdr			eth;
+	struct ether_arp		arp;
+} __attribute__((packed));
+
+static inline uint32_t neigh_hash(int family, const uint8_t *ip){
+	uint32_t h = family, i, len = (family == AF_INET6) ? 16 : 4;
+
+	for(i = 0; i < len; i++){
+		h = h * 31 + ip[i];
+	}
+
+	return h & (NEIGH_BUCKETS - 1);
+}
+
+void neigh_init(struct neigh_table *table){
+	memset(table, 0, sizeof(struct neigh_table));
+	pthread_mutex_init(&table->lock, NULL);
+	return;
+}
+
+void neigh_learn(struct neigh_table *table, int family, const uint8_t *ip,
+	const uint8_t *mac, int is_static){
+	struct neigh_entry *entry;
+	uint32_t bucket, len = (family == AF_INET6) ? 16 : 4;
+
+	/* neither unspecified nor multicast senders are neighbors */
+	if(mac[0] & 0x01){
+		return;
+	}
+
+	bucket = neigh_hash(family, ip);
+
+	pthread_mutex_lock(&table->lock);
+	for(entry = table->bucket[bucket]; entry != NULL; entry = entry->next){
+		if(entry->family == family && !memcmp(entry->ip, ip, len)){
+			break;
+		}
+	}
+
+	if(entry == NULL){
+		entry = malloc(sizeof(struct neigh_entry));
+		if(entry == NULL){
+			goto out;
+		}
+
+		memset(entry, 0, sizeof(struct neigh_entry));
+		entry->family = family;
+		memcpy(entry->ip, ip, len);
+		entry->next = table->bucket[bucket];
+		table->bucket[bucket] = entry;
+		table->count++;
+	}else if(entry->is_static && !is_static){
+		/* the orchestrator knows better than the wire */
+		goto out;
+	}
+
+	memcpy(entry->mac, mac, ETH_ALEN);
+	entry->is_static = is_static;
+
+out:
+	pthread_mutex_unlock(&table->lock);
+	return;
+}
+
+static int neigh_lookup(struct neigh_table *table, int family, const uint8_t *ip,
+	uint8_t *mac){
+	struct neigh_entry *entry;
+	uint32_t len = (family == AF_INET6) ? 16 : 4;
+	int found = 0;
+
+	pthread_mutex_lock(&table->lock);
+	for(entry = table->bucket[neigh_hash(family, ip)]; entry != NULL; entry = entry->next){
+		if(entry->family == family && !memcmp(entry->ip, ip, len)){
+			memcpy(mac, entry->mac, ETH_ALEN);
+			found = 1;
+			break;
+		}
+	}
+
+	if(found){
+		table->replies++;
+	}else{
+		table->misses++;
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	return found;
+}
+
+int neigh_preload(struct neigh_table *table, const char *path){
+	FILE *fp;
+	char line[256], ip_str[INET6_ADDRSTRLEN], mac_str[32];
+	uint8_t ip[16];
+	struct ether_addr *mac;
+	int family, num = 0;
+
+	fp = fopen(path, "r");
+	if(fp == NULL){
+		return -1;
+	}
+
+	/* one "<ip> <mac>" per line, '#' starts a comment */
+	while(fgets(line, sizeof(line), fp) != NULL){
+		if(line[0] == '#' || sscanf(line, "%45s %31s", ip_str, mac_str) != 2){
+			continue;
+		}
+
+		family = strchr(ip_str, ':') ? AF_INET6 : AF_INET;
+		mac = ether_aton(mac_str);
+		if(inet_pton(family, ip_str, ip) != 1 || mac == NULL){
+			printf("PROXY: ignored invalid neighbor \"%s %s\"\n", ip_str, mac_str);
+			continue;
+		}
+
+		neigh_learn(table, family, ip, mac->ether_addr_octet, 1);
+		num++;
+	}
+
+	fclose(fp);
+	return num;
+}
+
+static uint16_t proxy_icmp6_csum(const uint8_t *addrs, const uint8_t *icmp, uint32_t len){
+	uint32_t sum = 0, i;
+
+	/* pseudo header: source and destination address, length, next header */
+	for(i = 0; i < 32; i += 2){
+		sum += (addrs[i] << 8) | addrs[i + 1];
+	}
+	sum += len;
+	sum += IPPROTO_ICMPV6;
+
+	for(i = 0; i < len; i += 2){
+		sum += (icmp[i] << 8) | icmp[i + 1];
+	}
+
+	while(sum >> 16){
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return htons(~sum & 0xffff);
+}
+
+static int proxy_is_ns(void *frame, uint32_t size){
+	struct proxy_ns *ns = frame;
+
+	return size >= sizeof(struct proxy_ns)
+		&& ns->eth.h_proto == htons(ETH_P_IPV6)
+		&& ns->ip6.ip6_nxt == IPPROTO_ICMPV6
+		&& ns->ip6.ip6_hlim == 255
+		&& ns->ns.nd_ns_type == ND_NEIGHBOR_SOLICIT;
+}
+
+void proxy_snoop(struct neigh_table *table, void *frame, uint32_t size){
+	struct ethhdr *eth = frame;
+
+	if(eth->h_proto == htons(ETH_P_ARP)){
+		struct proxy_arp *arp = frame;
+
+		if(size < sizeof(struct proxy_arp)
+		|| arp->arp.arp_pro != htons(ETH_P_IP) || arp->arp.arp_pln != 4){
+			return;
+		}
+
+		/* both requests and replies tell us where the sender lives */
+		if(*(uint32_t *)arp->arp.arp_spa != 0){
+			neigh_learn(table, AF_INET, arp->arp.arp_spa, arp->arp.arp_sha, 0);
+		}
+	}else if(eth->h_proto == htons(ETH_P_IPV6)){
+		struct proxy_na *na = frame;
+
+		if(size < sizeof(struct proxy_na)
+		|| na->ip6.ip6_nxt != IPPROTO_ICMPV6 || na->opt.nd_opt_len != 1){
+			return;
+		}
+
+		if(na->na.nd_na_type == ND_NEIGHBOR_ADVERT
+		&& na->opt.nd_opt_type == ND_OPT_TARGET_LINKADDR){
+			neigh_learn(table, AF_INET6, (uint8_t *)&na->na.nd_na_target, na->lladdr, 0);
+		}else if(na->na.nd_na_type == ND_NEIGHBOR_SOLICIT
+		&& na->opt.nd_opt_type == ND_OPT_SOURCE_LINKADDR){
+			struct in6_addr src = na->ip6.ip6_src;
+
+			if(IN6_IS_ADDR_UNSPECIFIED(&src)){
+				return;
+			}
+
+			/* NS and NA share the layout up to the first option */
+			neigh_learn(table, AF_INET6, (uint8_t *)&na->ip6.ip6_src, na->lladdr, 0);
+		}
+	}
+
+	return;
+}
+
+uint32_t proxy_reply(struct neigh_table *table, void *frame, uint32_t size, void *reply){
+	struct ethhdr *eth = frame;
+	uint8_t mac[ETH_ALEN];
+
+	if(eth->h_proto == htons(ETH_P_ARP)){
+		struct proxy_arp *req = frame, *rep = reply;
+
+		if(size < sizeof(struct proxy_arp)
+		|| req->arp.arp_op != htons(ARPOP_REQUEST)
+		|| req->arp.arp_pro != htons(ETH_P_IP) || req->arp.arp_pln != 4
+		|| !memcmp(req->arp.arp_spa, req->arp.arp_tpa, 4)){
+			return 0;
+		}
+
+		if(!neigh_lookup(table, AF_INET, req->arp.arp_tpa, mac)){
+			return 0;
+		}
+
+		memcpy(rep->eth.h_dest, req->eth.h_source, ETH_ALEN);
+		memcpy(rep->eth.h_source, mac, ETH_ALEN);
+		rep->eth.h_proto = htons(ETH_P_ARP);
+
+		rep->arp.ea_hdr = req->arp.ea_hdr;
+		rep->arp.arp_op = htons(ARPOP_REPLY);
+		memcpy(rep->arp.arp_sha, mac, ETH_ALEN);
+		memcpy(rep->arp.arp_spa, req->arp.arp_tpa, 4);
+		memcpy(rep->arp.arp_tha, req->arp.arp_sha, ETH_ALEN);
+		memcpy(rep->arp.arp_tpa, req->arp.arp_spa, 4);
+
+		dprintf("PROXY: answered ARP request\n");
+		return sizeof(struct proxy_arp);
+	}
+
+	if(eth->h_proto == htons(ETH_P_IPV6) && proxy_is_ns(frame, size)){
+		struct proxy_ns *req = frame;
+		struct proxy_na *rep = reply;
+		struct in6_addr src = req->ip6.ip6_src;
+
+		/* duplicate address detection must see the real owner */
+		if(IN6_IS_ADDR_UNSPECIFIED(&src)){
+			return 0;
+		}
+
+		if(!neigh_lookup(table, AF_INET6, (uint8_t *)&req->ns.nd_ns_target, mac)){
+			return 0;
+		}
+
+		memset(rep, 0, sizeof(struct proxy_na));
+		memcpy(rep->eth.h_dest, req->eth.h_source, ETH_ALEN);
+		memcpy(rep->eth.h_source, mac, ETH_ALEN);
+		rep->eth.h_proto = htons(ETH_P_IPV6);
+
+		rep->ip6.ip6_flow = htonl(6 << 28);
+		rep->ip6.ip6_plen = htons(sizeof(struct nd_neighbor_advert)
+			+ sizeof(struct nd_opt_hdr) + ETH_ALEN);
+		rep->ip6.ip6_nxt = IPPROTO_ICMPV6;
+		rep->ip6.ip6_hlim = 255;
+		rep->ip6.ip6_src = req->ns.nd_ns_target;
+		rep->ip6.ip6_dst = req->ip6.ip6_src;
+
+		rep->na.nd_na_type = ND_NEIGHBOR_ADVERT;
+		rep->na.nd_na_flags_reserved = ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE;
+		rep->na.nd_na_target = req->ns.nd_ns_target;
+		rep->opt.nd_opt_type = ND_OPT_TARGET_LINKADDR;
+		rep->opt.nd_opt_len = 1;
+		memcpy(rep->lladdr, mac, ETH_ALEN);
+
+		rep->na.nd_na_cksum = proxy_icmp6_csum((uint8_t *)rep + offsetof(struct proxy_na, ip6.ip6_src),
+			(uint8_t *)rep + offsetof(struct proxy_na, na), ntohs(rep->ip6.ip6_plen));
+
+		dprintf("PROXY: answered neighbor solicitation\n");
+		return sizeof(struct proxy_na);
+	}
+
+	return 0;
+}
+
+int proxy_is_self(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *wc){
+	int i;
+
+	if(wc->slid != ss->portinfo.lid){
+		return 0;
+	}
+
+	for(i = 0; i < dev->queues; i++){
+		if(dev->queue[i].qp->qp_num == wc->src_qp){
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -14,111 +14,386 @@
 #include "nvoib_pci.h"
 #include "nvoib.h"
 
-void ring_tx_comp(struct nvoib_dev *dev){
-	struct shared_region *sr = dev->shared_region;
-	static uint32_t next_tx_comp = 0;
+/* interrupt the guest if it waits for one of the slots in [old, next_tx_comp) */
+static void ring_tx_notify(struct nvoib_queue *queue, uint32_t old){
+	smp_mb();
+	if(ring_need_event(queue->ring_size, *ring_tx_comp_event(queue), queue->next_tx_comp, old)){
+		event_notifier_set(&queue->rx_event);
+	}
+}
 
-#ifdef DEBUG
-	/* add used buffer to tx_used ring */
-        if(sr->tx.buf[next_tx_comp].flag != ENTRY_INFLIGHT){
-		/* TODO: queue next tx used */
-		printf("BUG: tx race condition\n");
-		exit(EXIT_FAILURE);
-        }
-#endif
+static void ring_tx_comp_flag(struct nvoib_queue *queue, uint32_t last){
+	struct shared_region *sr = queue->shared_region;
+	uint32_t end = (last + 1) % queue->ring_size;
 
-	int index = next_tx_comp;
-	next_tx_comp = (index + 1) % RING_SIZE;
+	/*
+	 * Retire every slot up to the signaled one. Inline slots in between
+	 * were completed at post time and may already be reused by the guest.
+	 */
+	while(queue->next_tx_comp != end){
+		uint32_t index = queue->next_tx_comp;
 
-	sr->tx.buf[index].flag	= ENTRY_COMPLETE;
+		if(sr->tx.buf[index].flag == ENTRY_INFLIGHT){
+			sr->tx.buf[index].flag = ENTRY_COMPLETE;
+		}
+		queue->next_tx_comp = (index + 1) % queue->ring_size;
+	}
+	smp_wmb();
 }
 
-void ring_rx_comp(struct nvoib_dev *dev, uint32_t size, int badget){
-	struct shared_region *sr = dev->shared_region;
-	static uint32_t next_rx_comp = 0;
-	int index;
+static void ring_rx_comp_flag(struct nvoib_queue *queue, uint32_t *size, int num){
+	struct shared_region *sr = queue->shared_region;
+	int i, index;
 
+	/* publish every size of the batch first, then flip the flags behind one fence */
+	index = queue->next_rx_comp;
+	for(i = 0; i < num; i++){
 #ifdef DEBUG
-	/* add skb to rx ring buffer */
-	if(sr->rx.buf[next_rx_comp].flag != ENTRY_INFLIGHT){
-		/* TODO: queue next rx avail */
-		printf("BUG: rx race condition\n");
-		exit(EXIT_FAILURE);
-	}
+		/* add skb to rx ring buffer */
+		if(sr->rx.buf[index].flag != ENTRY_INFLIGHT){
+			/* TODO: queue next rx avail */
+			printf("BUG: rx race condition\n");
+			exit(EXIT_FAILURE);
+		}
 #endif
-
-	index = next_rx_comp;
-	next_rx_comp = (index + 1) % RING_SIZE;
-	sr->rx.buf[index].size		= size;
+		sr->rx.buf[index].size		= size[i];
+		index = (index + 1) % queue->ring_size;
+	}
 	smp_wmb();
-	sr->rx.buf[index].flag		= ENTRY_COMPLETE;
 
-	dev->rx_remain++;
-	if(dev->rx_remain > badget){
-		/* wake up guest OS immediately because many packets are pended... */
-		smp_wmb();
-		if(sr->rx.interruptible){
-			event_notifier_set(&dev->rx_event);
-		}
-		dev->rx_remain = 0;
+	index = queue->next_rx_comp;
+	for(i = 0; i < num; i++){
+		sr->rx.buf[index].flag		= ENTRY_COMPLETE;
+		index = (index + 1) % queue->ring_size;
 	}
+	queue->next_rx_comp = index;
 }
 
-int ring_rx_avail(struct session *ss, struct nvoib_dev *dev){
-	struct shared_region *sr = dev->shared_region;
-	static uint32_t next_rx_avail = 0;
+static int ring_rx_avail_flag(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue){
+	struct shared_region *sr = queue->shared_region;
 	int ret = 0;
 
 	smp_rmb();
-	while(sr->rx.buf[next_rx_avail].flag == ENTRY_AVAILABLE){
+	while(sr->rx.buf[queue->next_rx_avail].flag == ENTRY_AVAILABLE){
 		uint64_t data_ptr;
 		uint32_t size;
 		int index;
 
-		index = next_rx_avail;
-		next_rx_avail = (index + 1) % RING_SIZE;
+		index = queue->next_rx_avail;
+		queue->next_rx_avail = (index + 1) % queue->ring_size;
 
 		smp_rmb();
 		data_ptr		= sr->rx.buf[index].data_ptr;
 		size			= sr->rx.buf[index].size;
 		sr->rx.buf[index].flag  = ENTRY_INFLIGHT;
 
-		nvoib_request_recv(ss, dev, data_ptr, size);
+		nvoib_request_recv(ss, dev, queue, index, data_ptr, size);
 
 		ret = 1;
 	}
 	smp_wmb();
 
+	nvoib_post_recv(queue);
+
 	return ret;
 }
 
-int ring_tx_avail(struct session *ss, struct nvoib_dev *dev, int badget){
-	struct shared_region *sr = dev->shared_region;
-	static uint32_t next_tx_avail = 0;
+/*
+ * Gather the descriptor chain of the frame at next_tx_avail.
+ * Returns its number of slots, or 0 while it can not be taken yet.
+ */
+static int ring_tx_chain_flag(struct nvoib_queue *queue, struct tx_frag *frag,
+	uint16_t *desc_flags, uint16_t *gso_size){
+	struct shared_region *sr = queue->shared_region;
+	uint32_t index = queue->next_tx_avail;
+	int nfrags = 0;
+
+	/* offload metadata lives in the first slot only */
+	*desc_flags	= sr->tx.buf[index].desc_flags;
+	*gso_size	= sr->tx.buf[index].gso_size;
+
+	while(1){
+		/* do not lap slots which still wait for their signaled completion */
+		if((index + 1) % queue->ring_size == queue->next_tx_comp
+		|| sr->tx.buf[index].flag != ENTRY_AVAILABLE){
+			return 0;
+		}
+
+		frag[nfrags].data_ptr	= sr->tx.buf[index].data_ptr;
+		frag[nfrags].size	= sr->tx.buf[index].size;
+		nfrags++;
+
+		/* a runaway chain is cut, the guest never builds one */
+		if(!(sr->tx.buf[index].desc_flags & DESC_F_NEXT) || nfrags == DESC_CHAIN_MAX){
+			return nfrags;
+		}
+
+		index = (index + 1) % queue->ring_size;
+	}
+}
+
+static int ring_tx_avail_flag(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, int badget){
+	struct shared_region *sr = queue->shared_region;
+	uint32_t inlined[TX_POLL_BADGET + DESC_CHAIN_MAX];
 	int ret = 0;
 	int work_done = 0;
+	int num_inlined = 0;
+	int i;
 
 	smp_rmb();
-	while(sr->tx.buf[next_tx_avail].flag == ENTRY_AVAILABLE && work_done < badget){
+	while(sr->tx.buf[queue->next_tx_avail].flag == ENTRY_AVAILABLE && work_done < badget){
+		struct tx_frag frag[DESC_CHAIN_MAX];
+		uint16_t desc_flags, gso_size;
+		int index, nfrags, sent;
+
+		/* the guest flips the first flag last, so the whole chain is in place */
+		smp_rmb();
+		nfrags = ring_tx_chain_flag(queue, frag, &desc_flags, &gso_size);
+		if(!nfrags){
+			break;
+		}
+
+		index = (queue->next_tx_avail + nfrags - 1) % queue->ring_size;
+		sent = nvoib_request_send(ss, dev, queue, index, frag, nfrags,
+			desc_flags, gso_size);
+		if(sent < 0){
+			/* the send queue is full, completions will make room */
+			queue->tx_blocked = 1;
+			break;
+		}
+
+		work_done += nfrags;
+		for(i = 0; i < nfrags; i++){
+			index = queue->next_tx_avail;
+			queue->next_tx_avail = (index + 1) % queue->ring_size;
+			sr->tx.buf[index].flag  = ENTRY_INFLIGHT;
+
+			if(sent){
+				inlined[num_inlined++] = index;
+			}
+		}
+
+		ret = 1;
+	}
+	smp_wmb();
+
+	nvoib_post_send(queue);
+
+	/* inline payloads were copied by the post, hand their slots back now */
+	for(i = 0; i < num_inlined; i++){
+		sr->tx.buf[inlined[i]].flag = ENTRY_COMPLETE;
+	}
+	if(num_inlined){
+		smp_wmb();
+	}
+
+	return ret;
+}
+
+static void ring_tx_comp_split(struct nvoib_queue *queue, uint32_t last, uint32_t seq){
+	struct split_region *sr = queue->shared_region;
+	uint32_t end = (last + 1) % queue->ring_size;
+
+	/* inline slots may have moved the used index past this completion already */
+	if((int32_t)(seq - queue->tx_comp_seq) <= 0){
+		return;
+	}
+
+	queue->tx_comp_seq = seq;
+	queue->next_tx_comp = end;
+	sr->tx.used = end;
+	smp_wmb();
+}
+
+static void ring_rx_comp_split(struct nvoib_queue *queue, uint32_t *size, int num){
+	struct split_region *sr = queue->shared_region;
+	int i, index;
+
+	/* fill in every size of the batch, then move the used index once */
+	index = queue->next_rx_comp;
+	for(i = 0; i < num; i++){
+		sr->rx.desc[index].size	= size[i];
+		index = (index + 1) % queue->ring_size;
+	}
+	smp_wmb();
+
+	sr->rx.used = index;
+	queue->next_rx_comp = index;
+}
+
+static int ring_rx_avail_split(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue){
+	struct split_region *sr = queue->shared_region;
+	uint32_t avail;
+	int ret = 0;
+
+	avail = sr->rx.avail;
+	smp_rmb();
+	while(queue->next_rx_avail != avail){
 		uint64_t data_ptr;
 		uint32_t size;
 		int index;
 
-		work_done++;
-		index = next_tx_avail;
-		next_tx_avail = (index + 1) % RING_SIZE;
+		index = queue->next_rx_avail;
+		queue->next_rx_avail = (index + 1) % queue->ring_size;
 
-		smp_rmb();
-		data_ptr		= sr->tx.buf[index].data_ptr;
-		size			= sr->tx.buf[index].size;
-		sr->tx.buf[index].flag  = ENTRY_INFLIGHT;
+		data_ptr		= sr->rx.desc[index].data_ptr;
+		size			= sr->rx.desc[index].size;
 
-		nvoib_request_send(ss, dev, data_ptr, size);
+		nvoib_request_recv(ss, dev, queue, index, data_ptr, size);
 
 		ret = 1;
 	}
-	smp_wmb();
+
+	nvoib_post_recv(queue);
+
+	return ret;
+}
+
+/*
+ * Gather the descriptor chain of the frame at next_tx_avail.
+ * Returns its number of slots, or 0 while avail does not cover it yet.
+ */
+static int ring_tx_chain_split(struct nvoib_queue *queue, uint32_t avail,
+	struct tx_frag *frag, uint16_t *desc_flags, uint16_t *gso_size){
+	struct split_region *sr = queue->shared_region;
+	uint32_t index = queue->next_tx_avail;
+	int nfrags = 0;
+
+	/* offload metadata lives in the first slot only */
+	*desc_flags	= sr->tx.desc[index].desc_flags;
+	*gso_size	= sr->tx.desc[index].gso_size;
+
+	while(index != avail){
+		frag[nfrags].data_ptr	= sr->tx.desc[index].data_ptr;
+		frag[nfrags].size	= sr->tx.desc[index].size;
+		nfrags++;
+
+		/* a runaway chain is cut, the guest never builds one */
+		if(!(sr->tx.desc[index].desc_flags & DESC_F_NEXT) || nfrags == DESC_CHAIN_MAX){
+			return nfrags;
+		}
+
+		index = (index + 1) % queue->ring_size;
+	}
+
+	return 0;
+}
+
+static int ring_tx_avail_split(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, int badget){
+	struct split_region *sr = queue->shared_region;
+	uint32_t inlined[TX_POLL_BADGET + DESC_CHAIN_MAX];
+	uint32_t inlined_seq[TX_POLL_BADGET + DESC_CHAIN_MAX];
+	uint32_t avail, old;
+	int ret = 0;
+	int work_done = 0;
+	int num_inlined = 0;
+	int i;
+
+	avail = sr->tx.avail;
+	smp_rmb();
+	while(queue->next_tx_avail != avail && work_done < badget){
+		struct tx_frag frag[DESC_CHAIN_MAX];
+		uint16_t desc_flags, gso_size;
+		int index, nfrags, sent;
+
+		nfrags = ring_tx_chain_split(queue, avail, frag, &desc_flags, &gso_size);
+		if(!nfrags){
+			break;
+		}
+
+		index = (queue->next_tx_avail + nfrags - 1) % queue->ring_size;
+		sent = nvoib_request_send(ss, dev, queue, index, frag, nfrags,
+			desc_flags, gso_size);
+		if(sent < 0){
+			/* the send queue is full, completions will make room */
+			queue->tx_blocked = 1;
+			break;
+		}
+
+		work_done += nfrags;
+		for(i = 0; i < nfrags; i++){
+			if(sent){
+				/* no WR of an earlier slot is newer than this frame's last one */
+				inlined_seq[num_inlined] = queue->tx_wr_seq;
+				inlined[num_inlined++] = queue->next_tx_avail;
+			}
+			queue->next_tx_avail = (queue->next_tx_avail + 1) % queue->ring_size;
+		}
+
+		ret = 1;
+	}
+
+	nvoib_post_send(queue);
+
+	/*
+	 * The used index can only move over a contiguous run, so inline
+	 * slots are handed back at once only while nothing is pending
+	 * in front of them; the others are retired by the next signal.
+	 */
+	old = queue->next_tx_comp;
+	for(i = 0; i < num_inlined; i++){
+		if(inlined[i] != queue->next_tx_comp){
+			break;
+		}
+		queue->next_tx_comp = (inlined[i] + 1) % queue->ring_size;
+		queue->tx_comp_seq = inlined_seq[i];
+	}
+	if(i){
+		sr->tx.used = queue->next_tx_comp;
+		ring_tx_notify(queue, old);
+	}
 
 	return ret;
 }
 
+void ring_tx_comp(struct nvoib_queue *queue, uint32_t last, uint32_t seq){
+	uint32_t old = queue->next_tx_comp;
+
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		ring_tx_comp_split(queue, last, seq);
+	}else{
+		ring_tx_comp_flag(queue, last);
+	}
+
+	ring_tx_notify(queue, old);
+}
+
+void ring_rx_comp(struct nvoib_queue *queue, uint32_t *size, int num){
+	uint32_t old = queue->next_rx_comp;
+
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		ring_rx_comp_split(queue, size, num);
+	}else{
+		ring_rx_comp_flag(queue, size, num);
+	}
+
+	/* interrupt only if the guest sleeps on a slot of this batch, and maybe not yet */
+	smp_mb();
+	if(coal_rx_comp(queue, num, ring_need_event(queue->ring_size, *ring_rx_event(queue),
+	queue->next_rx_comp, old), poll_now())){
+		event_notifier_set(&queue->rx_event);
+	}
+}
+
+int ring_rx_avail(struct session *ss, struct nvoib_dev *dev, struct nvoib_queue *queue){
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return ring_rx_avail_split(ss, dev, queue);
+	}
+
+	return ring_rx_avail_flag(ss, dev, queue);
+}
+
+int ring_tx_avail(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, int badget){
+	queue->tx_blocked = 0;
+
+	if(queue->ring_format == RING_FORMAT_SPLIT){
+		return ring_tx_avail_split(ss, dev, queue, badget);
+	}
+
+	return ring_tx_avail_flag(ss, dev, queue, badget);
+}
@@ -17,41 +17,101 @@
 #include "nvoib_pci.h"
 #include "nvoib.h"
 
+static int rx_busy_polled(struct nvoib_queue *queue);
+
 void *rx_wait(void *arg){
 	struct thread_param *param;
 	struct nvoib_dev *dev;
-	struct shared_region *sr;
+	struct nvoib_queue *queue;
 	struct session *ss;
-	int ep_fd, cc_fd, tm_fd;
+	int ep_fd, cc_fd, tm_fd, co_fd;
 	struct epoll_event ev_ret[MAX_EVENTS];
+	struct poll_state ps;
+	uint64_t now;
 	int i, fd_num, fd, timer_set = 0, miss_count = 0;
-        cpu_set_t cpu_mask;
-
-        CPU_ZERO(&cpu_mask);
-        CPU_SET(RX_CPU_AFFINITY, &cpu_mask);
-        if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask) != 0){
-                printf("Failed to set CPU affinity\n");
-                exit(EXIT_FAILURE);
-        }
+	int spin, work, timeout;
 
 	param	= (struct thread_param *)arg;
 	ss	= param->ss;
 	dev	= param->dev;
+	queue	= param->queue;
+
+	nvoib_set_affinity(queue->rx_cpu);
 
         if((ep_fd = epoll_create(MAX_EVENTS)) < 0){
                 exit(EXIT_FAILURE);
         }
 
-	cc_fd = ss->rx_cc->fd;
+	cc_fd = queue->rx_cc->fd;
 	nvoib_epoll_add(cc_fd, ep_fd);
 
         tm_fd = timerfd_create(CLOCK_MONOTONIC, 0);
         nvoib_epoll_add(tm_fd, ep_fd);
 
-	sr = dev->shared_region;
+	/* held back guest interrupts fire from here while we sleep */
+	co_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	nvoib_epoll_add(co_fd, ep_fd);
+	coal_init(&queue->rx_coal);
+
+	poll_state_init(&ps, dev->poll_mode);
+	spin = (dev->poll_mode == POLL_MODE_BUSY);
+
+	queue->learn_tokens = LEARN_BURST;
+	queue->learn_stamp = poll_now();
 
 	while(1){
-		if((fd_num = epoll_wait(ep_fd, ev_ret, MAX_EVENTS, -1)) < 0){
+		timeout = -1;
+
+		/* every received frame is checked against the fdb */
+		fdb_reader_online(&ss->fdb, FDB_RX_READER(queue->index));
+
+		if(spin){
+			now = poll_now();
+
+			/* no syscalls here: harvest the CQ and refill straight from the ring */
+			work = comp_poll(ss, queue->rx_cq, dev, queue,
+				comp_rx_work_completed, &queue->rx_stat);
+			work += ring_rx_avail(ss, dev, queue);
+
+			if(coal_rx_expired(queue, now)){
+				event_notifier_set(&queue->rx_event);
+			}
+
+			if(work){
+				poll_state_work(&ps, now);
+				if(!poll_state_epoll(&ps)){
+					continue;
+				}
+				timeout = 0;
+			}else if(poll_state_spin(&ps, now)){
+				/* drain the completion channel once in a while */
+				if(!poll_state_epoll(&ps)){
+					continue;
+				}
+				timeout = 0;
+			}else if(rx_busy_polled(queue)){
+				/* a guest socket spins on the ring, it wants every completion now */
+				poll_state_hold(&ps, now);
+				continue;
+			}else{
+				/* budget exhausted, the armed CQ will wake us up */
+				dprintf("RX: spin time out (budget = %lu ns)\n", ps.spin_budget);
+				nvoib_set_timer(tm_fd, dev->rx_interval);
+				spin = 0;
+				miss_count = 0;
+				timer_set = 1;
+			}
+		}
+
+		if(timeout != 0){
+			fdb_reader_offline(&ss->fdb, FDB_RX_READER(queue->index));
+			coal_rx_arm(queue, co_fd, poll_now());
+		}
+
+		fd_num = epoll_wait(ep_fd, ev_ret, MAX_EVENTS, timeout);
+		fdb_reader_online(&ss->fdb, FDB_RX_READER(queue->index));
+
+		if(fd_num < 0){
                         /* 'interrupted syscall error' occurs when using gdb */
                         continue;
                 }
@@ -60,34 +120,50 @@ void *rx_wait(void *arg){
 			fd = ev_ret[i].data.fd;
 
 			if(fd == cc_fd){
-                                comp_pull(ss, ss->rx_cc, dev, comp_rx_work_completed);
+                                comp_pull(ss, queue->rx_cc, dev, queue,
+					comp_rx_work_completed, &queue->rx_stat);
+				miss_count = 0;
 
-				if(!timer_set){
-					nvoib_set_timer(tm_fd, RX_POLL_INTERVAL);
+				if(dev->poll_mode != POLL_MODE_TIMER || rx_busy_polled(queue)){
+					if(timer_set){
+						nvoib_unset_timer(tm_fd);
+						timer_set = 0;
+					}
+					poll_state_work(&ps, poll_now());
+					spin = 1;
+				}else if(!timer_set){
+					nvoib_set_timer(tm_fd, dev->rx_interval);
 					timer_set = 1;
 				}
+			}else if(fd == co_fd){
+				nvoib_event_clear(co_fd);
+
+				if(coal_rx_expired(queue, poll_now())){
+					event_notifier_set(&queue->rx_event);
+				}
 			}else if(fd == tm_fd){
 				nvoib_event_clear(tm_fd);
 
-				if(dev->rx_remain){
-					smp_wmb();
-					if(sr->rx.interruptible){
-						event_notifier_set(&dev->rx_event);
-					}
-
-					dev->rx_remain = 0;
+				/* the guest is interrupted from ring_rx_comp(), only refill here */
+				if(ring_rx_avail(ss, dev, queue)){
 					miss_count = 0;
-					dprintf("RX: packet interrupt completed\n");
 				}else{
 					miss_count++;
 				}
 
-				if(ring_rx_avail(ss, dev)){
+				/* even a timer-mode host harvests the CQ itself for a busy poller */
+				if(!spin && rx_busy_polled(queue)){
+					nvoib_unset_timer(tm_fd);
+					timer_set = 0;
 					miss_count = 0;
+					poll_state_hold(&ps, poll_now());
+					spin = 1;
+					continue;
 				}
 
-				if(miss_count > RX_POLL_RETRY){
-					dprintf("RX: polling time out\n");
+				if(miss_count > dev->rx_retry){
+					dprintf("RX: polling time out (average wc batch = %.2f)\n",
+						comp_average_batch(&queue->rx_stat));
 					nvoib_unset_timer(tm_fd);
 					timer_set = 0;
 					miss_count = 0;
@@ -99,42 +175,114 @@ void *rx_wait(void *arg){
 	return 0;
 }
 
-void rx_fdb_learn(struct session *ss, struct ibv_wc *wc, void *buffer){
+/*
+ * Has a guest socket busy polled the RX ring since we last looked. The
+ * guest bumps a counter on every pass, we only sample it when we would
+ * otherwise stop spinning.
+ */
+static int rx_busy_polled(struct nvoib_queue *queue){
+	uint32_t busy = *ring_rx_busy(queue);
+
+	if(busy == queue->rx_busy_seen){
+		return 0;
+	}
+
+	queue->rx_busy_seen = busy;
+	return 1;
+}
+
+void rx_fdb_check(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, struct rx_slot *slot){
+	struct forward_entry *entry;
+	struct ibv_grh *grh;
+	struct ethhdr *eth;
+	uint64_t now, earned;
+
+	if(unlikely(!(wc->wc_flags & IBV_WC_GRH))){
+		return;
+	}
+
+	grh = &slot->grh;
+	eth = (struct ethhdr *)slot->frame;
+
+	/* our own floods come back through the multicast group */
+	if(unlikely((eth->h_source[0] & 0x01)
+	|| !memcmp(eth->h_source, dev->eth_addr->ether_addr_octet, ETH_ALEN))){
+		return;
+	}
+
+	/* the hot path: one probe, the peer is known and did not move */
+	entry = fdb_lookup(&ss->fdb, fdb_key(ss->fdb.tenant, eth->h_source));
+	if(likely(entry != NULL && entry->qpn == wc->src_qp && entry->ahe != NULL
+	&& entry->ahe->dlid == wc->slid
+	&& entry->ahe->gid.global.interface_id == grh->sgid.global.interface_id)){
+		/* keep talking peers from aging out, without dirtying the line each frame */
+		if(entry->seen != ss->fdb.clock){
+			entry->seen = ss->fdb.clock;
+		}
+		return;
+	}
+
+	/* proxy replies carry the peer's MAC but come from our own QP */
+	if(unlikely(dev->arp_proxy && proxy_is_self(ss, dev, wc))){
+		return;
+	}
+
+	/* miss or move, but a storm must not turn into one AH lookup per frame */
+	now = poll_now();
+	earned = (now - queue->learn_stamp) / LEARN_TOKEN_NS;
+	if(earned){
+		queue->learn_tokens = MIN(queue->learn_tokens + earned, (uint64_t)LEARN_BURST);
+		queue->learn_stamp += (uint64_t)earned * LEARN_TOKEN_NS;
+	}
+
+	if(queue->learn_tokens == 0){
+		return;
+	}
+	queue->learn_tokens--;
+
+	rx_fdb_learn(ss, queue, wc, slot);
+	return;
+}
+
+void rx_fdb_learn(struct session *ss, struct nvoib_queue *queue,
+	struct ibv_wc *wc, struct rx_slot *slot){
 	struct ethhdr *eth;
 	struct ibv_grh *grh;
-	struct ibv_ah_attr ah_attr;
 	struct forward_entry *entry;
 	struct forward_message message;
 
 	if(!(wc->wc_flags & IBV_WC_GRH)){
-		printf("RX: ARP packet arrived, but there is no GRH.\n");
+		printf("RX: packet arrived, but there is no GRH.\n");
 		return;
 	}
 
-	grh = (struct ibv_grh *)buffer;
-	eth = (struct ethhdr *)(buffer + sizeof(struct ibv_grh));
+	grh = &slot->grh;
+	eth = (struct ethhdr *)slot->frame;
 	entry = malloc(sizeof(struct forward_entry));
+	if(entry == NULL){
+		return;
+	}
 
-	memset(&ah_attr, 0, sizeof(struct ibv_ah_attr));
-	ah_attr.is_global       = 1;
-	ah_attr.grh.dgid        = grh->sgid;
-	ah_attr.dlid            = wc->slid;
-	ah_attr.port_num        = NVOIB_PORT;
-
-	entry->ah = ibv_create_ah(ss->pd, &ah_attr);
-	if(!entry->ah) {
-		printf("failed to create ah\n");
-		exit(EXIT_FAILURE);
+	entry->ahe = ah_cache_get(&ss->ah_cache, wc->slid, &grh->sgid, wc->sl);
+	if(entry->ahe == NULL){
+		free(entry);
+		return;
 	}
 
+	entry->ah = entry->ahe->ah;
 	entry->qpn = wc->src_qp;
+	entry->seen = poll_now();
+	entry->is_static = 0;
 
 	message.entry = entry;
-	message.hash_key = *(uint16_t *)&eth->h_source[4];
+	message.key = fdb_key(ss->fdb.tenant, eth->h_source);
 
-	if(mq_send(ss->mq_fd, (const char *)&message, sizeof(struct forward_message), 0) != 0){
-		printf("RX: failed to send message queue\n");
-		exit(EXIT_FAILURE);
+	if(fdb_learn_push(queue->learn, &message) < 0){
+		/* the TX thread is behind, the peer will ARP again */
+		dprintf("RX: learning ring full, dropped fdb register\n");
+		fdb_entry_free(&ss->fdb, entry);
+		return;
 	}
 
 	dprintf("RX: requested fdb register (lid = 0x%x, qpn = 0x%x)\n", wc->slid, wc->src_qp);
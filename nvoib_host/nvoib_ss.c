@@ -14,128 +14,255 @@
 #include "nvoib_pci.h"
 #include "nvoib.h"
 
+static struct ibv_context *session_open_device(struct nvoib_dev *dev);
 static int session_set_mr(struct session *ss, struct nvoib_dev *dev);
-static void session_prepare_multicast(struct session *ss, struct nvoib_dev *dev);
-static void session_start_rx(struct session *ss, struct nvoib_dev *dev);
-static void session_start_tx(struct session *ss);
+static void session_init_queue(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue);
+static void session_prepare_multicast(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue);
+static void session_start_rx(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue);
+static void session_start_tx(struct nvoib_queue *queue);
+static void session_prepare_proxy(struct session *ss, struct nvoib_dev *dev);
 
 struct session *session_init(struct nvoib_dev *dev){
 	struct session *ss;
-	struct ibv_device **dev_list;
-	struct ibv_device *ib_dev;
-	struct ibv_qp_init_attr qp_init_attr;
-	struct ibv_qp_attr qp_attr;
+	int i;
 
 	ss = malloc(sizeof(struct session));
 	memset(ss, 0, sizeof(struct session));
 
+	ss->ibverbs = session_open_device(dev);
+
+	ss->port_num = dev->hca_port;
+	if(ibv_query_port(ss->ibverbs, ss->port_num, &ss->portinfo)){
+		printf("failed to query port\n");
+		exit(EXIT_FAILURE);
+	}
+
+        ss->pd = ibv_alloc_pd(ss->ibverbs);
+        if (!ss->pd) {
+		printf("failed to alloc pd\n");
+		exit(EXIT_FAILURE);
+        }
+
+	ah_cache_init(&ss->ah_cache, ss->pd, ss->port_num);
+	fdb_init(&ss->fdb, dev->tenant_id, &ss->ah_cache);
+
+	if(session_set_mr(ss, dev)){
+		printf("failed to set mr\n");
+                exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < dev->queues; i++){
+		session_init_queue(ss, dev, &dev->queue[i]);
+	}
+
+	/* only the first QP joins the group, otherwise floods arrive N times */
+	session_prepare_multicast(ss, dev, &dev->queue[0]);
+
+	if(dev->arp_proxy){
+		session_prepare_proxy(ss, dev);
+	}
+
+	for(i = 0; i < dev->queues; i++){
+		session_start_rx(ss, dev, &dev->queue[i]);
+		session_start_tx(&dev->queue[i]);
+	}
+
+	return ss;
+}
+
+/* SGEs one send may gather on the HCA, capped to what a chain can need */
+uint32_t session_query_sge(struct nvoib_dev *dev){
+	struct ibv_context *ibverbs;
+	struct ibv_device_attr attr;
+
+	ibverbs = session_open_device(dev);
+
+	if(ibv_query_device(ibverbs, &attr)){
+		printf("failed to query device\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ibv_close_device(ibverbs);
+	return MIN(attr.max_sge, TX_SGE_MAX);
+}
+
+static struct ibv_context *session_open_device(struct nvoib_dev *dev){
+	struct ibv_context *ibverbs;
+	struct ibv_device **dev_list;
+	struct ibv_device *ib_dev;
+	int i;
+
         dev_list = ibv_get_device_list(NULL);
         if (!dev_list) {
                 printf("Failed to get IB devices list");
 		exit(EXIT_FAILURE);
         }
 
-	ib_dev = *dev_list;
+	for(i = 0; (ib_dev = dev_list[i]) != NULL; i++){
+		if(dev->hca_name == NULL
+		|| !strcmp(ibv_get_device_name(ib_dev), dev->hca_name)){
+			break;
+		}
+	}
+
 	if (!ib_dev) {
 		printf("No IB devices found\n");
 		exit(EXIT_FAILURE);
 	}
 
-        ss->ibverbs = ibv_open_device(ib_dev);
-        if(!ss->ibverbs) {
+        ibverbs = ibv_open_device(ib_dev);
+        if(!ibverbs) {
 		printf("failed to open device\n");
 		exit(EXIT_FAILURE);
         }
 
-	if(ibv_query_port(ss->ibverbs, NVOIB_PORT, &ss->portinfo)){
-		printf("failed to query port\n");
+	ibv_free_device_list(dev_list);
+	return ibverbs;
+}
+
+static void session_init_queue(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue){
+	struct ibv_qp_init_attr qp_init_attr;
+	struct ibv_qp_attr qp_attr;
+	int comp_vectors = ss->ibverbs->num_comp_vectors;
+
+	queue->tx_chain = malloc(sizeof(struct send_chain));
+	queue->rx_chain = malloc(sizeof(struct recv_chain));
+	if(!queue->tx_chain || !queue->rx_chain){
+		printf("failed to alloc wr chain\n");
 		exit(EXIT_FAILURE);
 	}
+	memset(queue->tx_chain, 0, sizeof(struct send_chain));
+	memset(queue->rx_chain, 0, sizeof(struct recv_chain));
 
-        ss->pd = ibv_alloc_pd(ss->ibverbs);
-        if (!ss->pd) {
-		printf("failed to alloc pd\n");
+	queue->learn = fdb_learn_alloc();
+
+	/* GRHs of received frames are split off into here */
+	queue->rx_slot = malloc(queue->ring_size * sizeof(struct rx_slot));
+	if(!queue->rx_slot){
+		printf("failed to alloc rx slots\n");
 		exit(EXIT_FAILURE);
-        }
+	}
+	memset(queue->rx_slot, 0, queue->ring_size * sizeof(struct rx_slot));
 
-	if(session_set_mr(ss, dev)){
-		printf("failed to set mr\n");
-                exit(EXIT_FAILURE);
+	queue->rx_slot_mr = ibv_reg_mr(ss->pd, queue->rx_slot,
+		queue->ring_size * sizeof(struct rx_slot), IBV_ACCESS_LOCAL_WRITE);
+	if(!queue->rx_slot_mr){
+		printf("failed to register rx slots\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Segment headers are rebuilt here, one slot per send WR. Sends with
+	 * more SGEs than the HCA gathers are copied in whole, so the slot
+	 * grows to an MTU then.
+	 */
+	queue->tx_hdr_size = TX_GSO_HDR_MAX;
+	if(dev->tx_sge < TX_SGE_MAX){
+		queue->tx_hdr_size = MAX(TX_GSO_HDR_MAX, 128 << ss->portinfo.active_mtu);
+	}
+
+	queue->tx_hdr = malloc(queue->ring_size * queue->tx_hdr_size);
+	if(!queue->tx_hdr){
+		printf("failed to alloc tx header buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	queue->tx_hdr_mr = ibv_reg_mr(ss->pd, queue->tx_hdr,
+		queue->ring_size * queue->tx_hdr_size, IBV_ACCESS_LOCAL_WRITE);
+	if(!queue->tx_hdr_mr){
+		printf("failed to register tx header buffer\n");
+		exit(EXIT_FAILURE);
 	}
 
 	/* TX completion queue init */
-        ss->tx_cc = ibv_create_comp_channel(ss->ibverbs);
-        if (!ss->tx_cc) {
+        queue->tx_cc = ibv_create_comp_channel(ss->ibverbs);
+        if (!queue->tx_cc) {
                 printf("failed to create comp tx comp channel");
                 exit(EXIT_FAILURE);
         }
 
-        ss->tx_cq = ibv_create_cq(ss->ibverbs, RING_SIZE, NULL, ss->tx_cc, TX_CPU_AFFINITY);
-        if (!ss->tx_cq) {
+        queue->tx_cq = ibv_create_cq(ss->ibverbs, queue->ring_size, NULL, queue->tx_cc,
+		queue->tx_cpu % comp_vectors);
+        if (!queue->tx_cq) {
 		printf("failed to create tx completion queue\n");
 		exit(EXIT_FAILURE);
         }
 
-        if(ibv_req_notify_cq(ss->tx_cq, 0) != 0){
+        if(ibv_req_notify_cq(queue->tx_cq, 0) != 0){
 		printf("failed to request notifying tx cq\n");
                 exit(EXIT_FAILURE);
         }
 
 	/* RX completion queue init */
-        ss->rx_cc = ibv_create_comp_channel(ss->ibverbs);
-        if (!ss->rx_cc) {
+        queue->rx_cc = ibv_create_comp_channel(ss->ibverbs);
+        if (!queue->rx_cc) {
 		printf("failed to create rx comp channel\n");
 		exit(EXIT_FAILURE);
         }
 
-        ss->rx_cq = ibv_create_cq(ss->ibverbs, RING_SIZE, NULL, ss->rx_cc, RX_CPU_AFFINITY);
-        if (!ss->rx_cq) {
+        queue->rx_cq = ibv_create_cq(ss->ibverbs, queue->ring_size, NULL, queue->rx_cc,
+		queue->rx_cpu % comp_vectors);
+        if (!queue->rx_cq) {
 		printf("failed to create rx completion queue\n");
 		exit(EXIT_FAILURE);
         }
 
-        if(ibv_req_notify_cq(ss->rx_cq, 0) != 0){
+        if(ibv_req_notify_cq(queue->rx_cq, 0) != 0){
                 printf("failed to request notifying rx cq\n");
                 exit(EXIT_FAILURE);
         }
 
 	/* Create QP */
 	memset(&qp_init_attr, 0, sizeof(struct ibv_qp_init_attr));
-	qp_init_attr.send_cq = ss->tx_cq;
-	qp_init_attr.recv_cq = ss->rx_cq;
-	qp_init_attr.cap.max_send_wr = RING_SIZE;
-	qp_init_attr.cap.max_recv_wr = RING_SIZE;
-	qp_init_attr.cap.max_send_sge = 1;
-	qp_init_attr.cap.max_recv_sge = 1;
+	qp_init_attr.send_cq = queue->tx_cq;
+	qp_init_attr.recv_cq = queue->rx_cq;
+	qp_init_attr.cap.max_send_wr = queue->ring_size;
+	qp_init_attr.cap.max_recv_wr = queue->ring_size;
+	qp_init_attr.cap.max_send_sge = dev->tx_sge;
+	qp_init_attr.cap.max_recv_sge = RX_SGE_MAX;
+	qp_init_attr.cap.max_inline_data = dev->tx_inline;
 	qp_init_attr.qp_type = IBV_QPT_UD;
 
-	ss->qp = ibv_create_qp(ss->pd, &qp_init_attr);
-	if (!ss->qp)  {
+	/* proxy replies are always sent inline */
+	if(dev->arp_proxy && qp_init_attr.cap.max_inline_data < PROXY_FRAME_MAX){
+		qp_init_attr.cap.max_inline_data = PROXY_FRAME_MAX;
+	}
+
+	queue->qp = ibv_create_qp(ss->pd, &qp_init_attr);
+	if (!queue->qp)  {
 		printf("failed to create qp\n");
 		exit(EXIT_FAILURE);
 	}
 
-	printf("MAIN: local lid = %x, local qpn = %x\n", ss->portinfo.lid, ss->qp->qp_num);
+	/* the HCA may give us less inline space than requested */
+	if(qp_init_attr.cap.max_inline_data < dev->tx_inline){
+		dev->tx_inline = qp_init_attr.cap.max_inline_data;
+	}
+
+	if(dev->arp_proxy && qp_init_attr.cap.max_inline_data < PROXY_FRAME_MAX){
+		printf("MAIN: not enough inline space, ARP/ND proxy disabled\n");
+		dev->arp_proxy = 0;
+	}
+
+	printf("MAIN: queue %d: local lid = %x, local qpn = %x, max inline = %u\n",
+		queue->index, ss->portinfo.lid, queue->qp->qp_num, dev->tx_inline);
 
 	/* Set Qkey to QP */
 	memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
 	qp_attr.qp_state	= IBV_QPS_INIT;
 	qp_attr.pkey_index	= 0; /* partition key's index (like vlan) */
-	qp_attr.port_num	= NVOIB_PORT;
+	qp_attr.port_num	= ss->port_num;
 	qp_attr.qkey		= dev->tenant_id; 
 
-	if(ibv_modify_qp(ss->qp, &qp_attr,
+	if(ibv_modify_qp(queue->qp, &qp_attr,
 	IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)){
 		printf("failed to modify qp\n");
 		exit(EXIT_FAILURE);
 	}
-
-	session_prepare_multicast(ss, dev);
-
-	session_start_rx(ss, dev);
-	session_start_tx(ss);
-
-	return ss;
 }
 
 static int session_set_mr(struct session *ss, struct nvoib_dev *dev){
@@ -148,18 +275,18 @@ static int session_set_mr(struct session *ss, struct nvoib_dev *dev){
 	return 0;
 }
 
-static void session_prepare_multicast(struct session *ss, struct nvoib_dev *dev){
+static void session_prepare_multicast(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue){
 	union ibv_gid mgid;
 	struct ibv_ah_attr ah_attr;
 	struct forward_entry *entry;
-	volatile struct forward_db *fdb;
 
 	dprintf("MAIN: multicast init tenant_id = %d\n", dev->tenant_id);
 
         /* attach qp to multicast group */
         inet_pton(AF_INET6, MCAST_BASE, mgid.raw);
         *(uint32_t *)(&mgid.raw[12]) = htonl(dev->tenant_id);
-        if (ibv_attach_mcast(ss->qp, &mgid, 0xc000 + dev->tenant_id)){
+        if (ibv_attach_mcast(queue->qp, &mgid, 0xc000 + dev->tenant_id)){
                 printf("failed to attach qp to multicast group\n");
                 exit(EXIT_FAILURE);
         }
@@ -170,7 +297,7 @@ static void session_prepare_multicast(struct session *ss, struct nvoib_dev *dev)
         ah_attr.is_global	= 1;
 	ah_attr.grh.dgid	= mgid;
         ah_attr.dlid		= 0xc000 + dev->tenant_id;
-        ah_attr.port_num	= NVOIB_PORT;
+        ah_attr.port_num	= ss->port_num;
         entry->ah = ibv_create_ah(ss->pd, &ah_attr);
         if(!entry->ah) {
                 printf("failed to create ah\n");
@@ -178,35 +305,85 @@ static void session_prepare_multicast(struct session *ss, struct nvoib_dev *dev)
         }
 
 	entry->qpn = 0xffffff;
+	entry->ahe = NULL;
+	entry->seen = 0;
+	entry->is_static = 1;
 
-	fdb = (volatile struct forward_db *)&ss->fdb;
-	fdb->entry[0] = entry;
+	ss->fdb.flood = entry;
+	smp_wmb();
 	return;
 }
 
-static void session_start_rx(struct session *ss, struct nvoib_dev *dev){
+static void session_start_rx(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue){
 	struct ibv_qp_attr qp_attr;
 
 	/* move qp state to Ready to Receive */
 	qp_attr.qp_state = IBV_QPS_RTR;
 
-        if(ibv_modify_qp(ss->qp, &qp_attr, IBV_QP_STATE)) {
+        if(ibv_modify_qp(queue->qp, &qp_attr, IBV_QP_STATE)) {
 		printf("failed to move qp state to Ready to Receive\n");
 		exit(EXIT_FAILURE);
         }
 
-	ring_rx_avail(ss, dev);
+	ring_rx_avail(ss, dev, queue);
 }
 
-static void session_start_tx(struct session *ss){
+static void session_start_tx(struct nvoib_queue *queue){
 	struct ibv_qp_attr qp_attr;
 
         qp_attr.qp_state       = IBV_QPS_RTS;
 	/* set initial packet sequence number */
         qp_attr.sq_psn         = lrand48() & 0xffffff;
 
-        if (ibv_modify_qp(ss->qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+        if (ibv_modify_qp(queue->qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
 		printf("failed to move qp state to Ready to Send\n");
 		exit(EXIT_FAILURE);
         }
 }
+
+static void session_prepare_proxy(struct session *ss, struct nvoib_dev *dev){
+	struct ibv_ah_attr ah_attr;
+	union ibv_gid gid;
+	int i, num;
+
+	neigh_init(&ss->neigh);
+
+	if(dev->neigh_file != NULL){
+		num = neigh_preload(&ss->neigh, dev->neigh_file);
+		if(num < 0){
+			printf("MAIN: could not open neigh_file %s\n", dev->neigh_file);
+			exit(EXIT_FAILURE);
+		}
+		printf("MAIN: preloaded %d neighbors\n", num);
+	}
+
+	if(ibv_query_gid(ss->ibverbs, ss->port_num, 0, &gid)){
+		printf("failed to query gid\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* replies come back to the QP of the asking queue through the HCA loopback */
+	memset(&ah_attr, 0, sizeof(struct ibv_ah_attr));
+	ah_attr.is_global	= 1;
+	ah_attr.grh.dgid	= gid;
+	ah_attr.dlid		= ss->portinfo.lid;
+	ah_attr.port_num	= ss->port_num;
+	ss->self.ah = ibv_create_ah(ss->pd, &ah_attr);
+	if(!ss->self.ah){
+		printf("failed to create ah\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < dev->queues; i++){
+		dev->queue[i].proxy_buf = malloc(PROXY_CHAIN_MAX * PROXY_FRAME_MAX);
+		if(dev->queue[i].proxy_buf == NULL){
+			printf("failed to alloc proxy buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		dev->queue[i].proxy_used = 0;
+	}
+
+	printf("MAIN: ARP/ND proxy enabled\n");
+	return;
+}
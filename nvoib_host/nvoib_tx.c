@@ -12,56 +12,105 @@
 #include <netinet/ether.h>
 #include <infiniband/verbs.h>
 #include <mqueue.h>
+#include <pthread.h>
 
 #include "debug.h"
 #include "nvoib_pci.h"
 #include "nvoib.h"
 
-static void tx_fdb_register(struct forward_db *fdb, struct forward_message *message);
-
 void *tx_wait(void *arg){
 	struct thread_param *param;
 	struct session *ss;
 	struct nvoib_dev *dev;
+	struct nvoib_queue *queue;
         struct epoll_event ev_ret[MAX_EVENTS];
         int i, fd_num, fd, timer_set = 0, miss_count = 0;
-	int ep_fd, tm_fd, ev_fd, cc_fd, mq_fd;
-        char *mq_buf;
-        struct mq_attr mq_attr;
-	cpu_set_t cpu_mask;
-
-	CPU_ZERO(&cpu_mask);
-	CPU_SET(TX_CPU_AFFINITY, &cpu_mask);
-	if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask) != 0){
-		printf("Failed to set CPU affinity\n");
-		exit(EXIT_FAILURE);
-	}
+	int spin, work, timeout;
+	struct poll_state ps;
+	uint64_t now;
+	int ep_fd, tm_fd, ev_fd, cc_fd;
 
 	param	= (struct thread_param *)arg;
 	ss	= param->ss;
 	dev	= param->dev;
+	queue	= param->queue;
+
+	nvoib_set_affinity(queue->tx_cpu);
 
         if((ep_fd = epoll_create(MAX_EVENTS)) < 0){
                 exit(EXIT_FAILURE);
         }
 
-	ev_fd = event_notifier_get_fd(&dev->tx_event);
+	ev_fd = event_notifier_get_fd(&queue->tx_event);
 	nvoib_epoll_add(ev_fd, ep_fd);
 
 	tm_fd = timerfd_create(CLOCK_MONOTONIC, 0);
 	nvoib_epoll_add(tm_fd, ep_fd);
 
-        cc_fd = ss->tx_cc->fd;
+        cc_fd = queue->tx_cc->fd;
         nvoib_epoll_add(cc_fd, ep_fd);
 
-	mq_getattr(ss->mq_fd, &mq_attr);
-	mq_buf = malloc(mq_attr.mq_msgsize);
+	poll_state_init(&ps, dev->poll_mode);
+	spin = (dev->poll_mode == POLL_MODE_BUSY);
+	if(spin){
+		nvoib_kick_disable(queue);
+	}
 
-	mq_fd = (int)ss->mq_fd;
-	nvoib_epoll_add(mq_fd, ep_fd);
+	fdb_reader_online(&ss->fdb, queue->index);
 
 	while(1){
-                if((fd_num = epoll_wait(ep_fd, ev_ret, MAX_EVENTS, -1)) < 0){
+		timeout = -1;
+
+		/* nothing looked up in a previous round is referenced any more */
+		fdb_reader_online(&ss->fdb, queue->index);
+
+		if(spin){
+			now = poll_now();
+
+			/* kicks stay suppressed while we are watching the ring ourselves */
+			work = fdb_learn_drain(&ss->fdb, queue->learn, LEARN_BADGET);
+			work += ring_tx_avail(ss, dev, queue, dev->tx_badget);
+			work += comp_poll(ss, queue->tx_cq, dev, queue,
+				comp_tx_work_completed, &queue->tx_stat);
+
+			/* under steady traffic we may never get to the epoll below */
+			fdb_age(&ss->fdb);
+
+			if(work){
+				poll_state_work(&ps, now);
+				if(!poll_state_epoll(&ps)){
+					continue;
+				}
+				timeout = 0;
+			}else if(poll_state_spin(&ps, now)){
+				/* stale channel events still need an epoll */
+				if(!poll_state_epoll(&ps)){
+					continue;
+				}
+				timeout = 0;
+			}else{
+				/* budget exhausted, fall back to the timer which re-enables kicks */
+				dprintf("TX: spin time out (budget = %lu ns)\n", ps.spin_budget);
+				nvoib_set_timer(tm_fd, dev->tx_interval);
+				spin = 0;
+				miss_count = 0;
+				timer_set = 1;
+			}
+		}
+
+		/* a sleeping reader must not hold back fdb reclamation */
+		if(timeout != 0){
+			fdb_reader_offline(&ss->fdb, queue->index);
+		}
+
+                fd_num = epoll_wait(ep_fd, ev_ret, MAX_EVENTS, timeout);
+		fdb_reader_online(&ss->fdb, queue->index);
+
+		/* peers learned while we slept should not be flooded to */
+		fdb_learn_drain(&ss->fdb, queue->learn, LEARN_BADGET);
+		fdb_age(&ss->fdb);
+
+		if(fd_num < 0){
                         /* 'interrupted syscall error' occurs when using gdb */
                         continue;
                 }
@@ -71,46 +120,59 @@ void *tx_wait(void *arg){
 
 			if(fd == ev_fd){
 				dprintf("TX: host kick\n");
-				event_notifier_test_and_clear(&dev->tx_event);
-
-				if(!timer_set){
-					nvoib_kick_disable(dev);
-					nvoib_set_timer(tm_fd, TX_POLL_INTERVAL);
-					ring_tx_avail(ss, dev, TX_POLL_BADGET);
+				event_notifier_test_and_clear(&queue->tx_event);
+
+				if(dev->poll_mode != POLL_MODE_TIMER){
+					if(!spin){
+						nvoib_kick_disable(queue);
+						if(timer_set){
+							nvoib_unset_timer(tm_fd);
+							timer_set = 0;
+						}
+						poll_state_work(&ps, poll_now());
+						spin = 1;
+					}
+				}else if(!timer_set){
+					nvoib_kick_disable(queue);
+					nvoib_set_timer(tm_fd, dev->tx_interval);
+					ring_tx_avail(ss, dev, queue, dev->tx_badget);
 					miss_count = 0;
 					timer_set = 1;
 				}
 			}else if(fd == tm_fd){
                                 nvoib_event_clear(tm_fd);
 
-				if(ring_tx_avail(ss, dev, TX_POLL_BADGET)){
+				if(ring_tx_avail(ss, dev, queue, dev->tx_badget)){
 					dprintf("TX: packet sending completed\n");
 					miss_count = 0;
 				}else{
 					miss_count++;
 				}
 
-				if(miss_count > TX_POLL_RETRY){
-					dprintf("TX: polling time out\n");
+				if(miss_count > dev->tx_retry){
+					dprintf("TX: polling time out (average wc batch = %.2f)\n",
+						comp_average_batch(&queue->tx_stat));
 					nvoib_unset_timer(tm_fd);
-					nvoib_kick_enable(dev);
+					nvoib_kick_enable(queue);
 					timer_set = 0;
+
+					/* the guest may have filled our slot before it saw the event index */
+					if(ring_tx_avail(ss, dev, queue, dev->tx_badget)){
+						nvoib_kick_disable(queue);
+						nvoib_set_timer(tm_fd, dev->tx_interval);
+						miss_count = 0;
+						timer_set = 1;
+					}
 				}
                         }else if(fd == cc_fd){
                                 dprintf("TX: completion occured\n");
-                                comp_pull(ss, ss->tx_cc, dev, comp_tx_work_completed);
-				smp_wmb();
-			}else if(fd == mq_fd){
-				struct forward_message *message;
-
-				if(mq_receive(ss->mq_fd, mq_buf, mq_attr.mq_msgsize, NULL) < 0){
-					printf("TX: failed to receive message queue\n");
-					exit(EXIT_FAILURE);
-				}
+                                comp_pull(ss, queue->tx_cc, dev, queue,
+					comp_tx_work_completed, &queue->tx_stat);
 
-				message = (struct forward_message *)mq_buf;
-				tx_fdb_register(&ss->fdb, message);
-				dprintf("TX: registered new fdb entry\n");
+				/* frames left behind by a full send queue fit now */
+				if(queue->tx_blocked){
+					ring_tx_avail(ss, dev, queue, dev->tx_badget);
+				}
 			}
 		}
 	} 
@@ -118,29 +180,17 @@ void *tx_wait(void *arg){
 	return NULL;
 }
 
-static void tx_fdb_register(struct forward_db *fdb, struct forward_message *message){
-
-	if(fdb->entry[message->hash_key] != NULL){
-		free(fdb->entry[message->hash_key]);
-	}
-
-	fdb->entry[message->hash_key] = message->entry;
-	return;
-}
-
 struct forward_entry *tx_fdb_lookup(struct forward_db *fdb, void *buffer){
 	struct forward_entry *entry;
 	struct ethhdr *eth;
-	uint16_t src_hash;
 
 	eth = (struct ethhdr *)buffer;
-	src_hash = *(uint16_t *)&eth->h_dest[4];
-	entry = fdb->entry[src_hash];
+	entry = fdb_lookup(fdb, fdb_key(fdb->tenant, eth->h_dest));
 
 	if(unlikely(!entry)){
 		/* did not learn */
 		dprintf("TX: Unknown destination. flooding...\n");
-		return fdb->entry[0];
+		return fdb->flood;
 	}
 
 	return entry;
@@ -13,11 +13,46 @@
 #include "nvoib_pci.h"
 #include "nvoib.h"
 
+static int nvoib_request_send_gso(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, uint32_t index, struct tx_frag *frag, int nfrags,
+	uint16_t desc_flags, uint16_t gso_size);
+
+int comp_poll(struct session *ss, struct ibv_cq *cq,
+	struct nvoib_dev *dev, struct nvoib_queue *queue,
+	comp_f func, struct comp_stat *stat){
+
+	struct ibv_wc wc[WC_POLL_BADGET];
+	int i, num, total = 0;
+
+	while((num = ibv_poll_cq(cq, WC_POLL_BADGET, wc)) > 0){
+		for(i = 0; i < num; i++){
+			if(wc[i].status != IBV_WC_SUCCESS){
+				printf("poll_cq: status(%d) is not IBV_WC_SUCCESS\n", wc[i].status);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		stat->polls++;
+		stat->wcs += num;
+
+		/* hand the whole batch over so ring updates are fenced only once */
+		func(ss, dev, queue, wc, num);
+		total += num;
+	}
+
+	if(num < 0){
+		printf("poll_cq: failed to poll completion queue\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return total;
+}
+
 void comp_pull(struct session *ss, struct ibv_comp_channel *cc,
-	struct nvoib_dev *dev, comp_f func){
+	struct nvoib_dev *dev, struct nvoib_queue *queue,
+	comp_f func, struct comp_stat *stat){
 
 	struct ibv_cq *cq;
-	struct ibv_wc wc;
 	void *cq_context;
 
 	if(ibv_get_cq_event(cc, &cq, (void **)&cq_context) != 0){
@@ -30,96 +65,411 @@ void comp_pull(struct session *ss, struct ibv_comp_channel *cc,
 		exit(EXIT_FAILURE);
 	}
 
-	while(ibv_poll_cq(cq, 1, &wc)){
-		if (wc.status == IBV_WC_SUCCESS){
-			func(ss, dev, &wc);
-		}else{
-			printf("poll_cq: status(%d) is not IBV_WC_SUCCESS\n", wc.status);
-			exit(EXIT_FAILURE);
-		}
+	comp_poll(ss, cq, dev, queue, func, stat);
+	return;
+}
+
+double comp_average_batch(struct comp_stat *stat){
+	if(!stat->polls){
+		return 0;
 	}
 
-	return;
+	return (double)stat->wcs / stat->polls;
 }
 
-void comp_rx_work_completed(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *wc){
+void comp_rx_work_completed(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, int num){
+
+	uint32_t size[WC_POLL_BADGET];
+	struct rx_slot *slot;
+	int i, count = 0;
+
+	dprintf("RX: %d wcs are IBV_WC_SUCCESS\n", num);
+	for(i = 0; i < num; i++){
+		if(wc[i].opcode != IBV_WC_RECV){
+			continue;
+		}
+
+		dprintf("RX: arrived size (including GRH) = %d\n", wc[i].byte_len);
 
-	dprintf("RX: wc status is IBV_WC_SUCCESS\n");
-	if(wc->opcode == IBV_WC_RECV){
-		dprintf("RX: arrived size (including GRH) = %d\n", wc->byte_len);
+		slot = &queue->rx_slot[wc[i].wr_id];
+		rx_fdb_check(ss, dev, queue, &wc[i], slot);
 
-		if(IS_ARP(wc->wr_id + sizeof(struct ibv_grh))){
-			rx_fdb_learn(ss, wc, (void *)(wc->wr_id));
+		if(unlikely(dev->arp_proxy)){
+			proxy_snoop(&ss->neigh, slot->frame,
+				wc[i].byte_len - sizeof(struct ibv_grh));
 		}
 
-		ring_rx_comp(dev, wc->byte_len, RX_POLL_BADGET);
+		/* the guest only sees the frame */
+		size[count++] = wc[i].byte_len - sizeof(struct ibv_grh);
+	}
+
+	if(count){
+		ring_rx_comp(queue, size, count);
 		dprintf("RX: completed\n");
 	}
 }
 
-void comp_tx_work_completed(struct session *ss, struct nvoib_dev *dev, struct ibv_wc *wc){
+void comp_tx_work_completed(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, struct ibv_wc *wc, int num){
 
-	dprintf("TX: wc status is IBV_WC_SUCCESS\n");
-	if(wc->opcode == IBV_WC_SEND){
-		ring_tx_comp(dev);
+	int i, last = -1;
+
+	dprintf("TX: %d wcs are IBV_WC_SUCCESS\n", num);
+	for(i = 0; i < num; i++){
+		if(wc[i].opcode != IBV_WC_SEND){
+			continue;
+		}
+
+		queue->tx_wr_done = TX_WR_SEQ(wc[i].wr_id);
+		if(!(wc[i].wr_id & TX_WR_NOSLOT)){
+			last = i;
+		}
+	}
+
+	/* sends complete in order, so the last signaled one covers the batch */
+	if(last >= 0){
+		ring_tx_comp(queue, TX_WR_SLOT(wc[last].wr_id), TX_WR_SEQ(wc[last].wr_id));
 		dprintf("TX: completed\n");
 	}
 }
 
 void nvoib_request_recv(struct session *ss, struct nvoib_dev *dev,
-	uint64_t data_ptr, uint32_t size){
+	struct nvoib_queue *queue, uint32_t index, uint64_t data_ptr, uint32_t size){
 
-        struct ibv_recv_wr wr, *bad_wr = NULL;
-        struct ibv_sge sge;
-	uintptr_t buffer;
+	struct recv_chain *chain = queue->rx_chain;
+	struct rx_slot *slot = &queue->rx_slot[index];
+	struct ibv_recv_wr *wr;
+	struct ibv_sge *sge;
 
-        memset(&wr, 0, sizeof(wr));
-	buffer = (uintptr_t)dev->guest_memory + data_ptr;
+	if(chain->num == TX_POLL_BADGET){
+		nvoib_post_recv(queue);
+	}
+
+	wr = &chain->wr[chain->num];
+	sge = chain->sge[chain->num];
+	slot->frame = (uint8_t *)dev->guest_memory + data_ptr;
+
+	wr->wr_id = index;
+	wr->sg_list = sge;
+	wr->num_sge = RX_SGE_MAX;
+	wr->next = NULL;
+
+	/* the first 40 bytes of a UD receive are the GRH, keep them to ourselves */
+	sge[0].addr = (uintptr_t)&slot->grh;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = queue->rx_slot_mr->lkey;
 
-        wr.wr_id = buffer;
-        wr.sg_list = &sge;
-        wr.num_sge = 1;
+	sge[1].addr = (uintptr_t)slot->frame;
+	sge[1].length = size;
+	sge[1].lkey = ss->guest_memory_mr->lkey;
 
-        sge.addr = buffer;
-        sge.length = size;
-        sge.lkey = ss->guest_memory_mr->lkey;
+	if(chain->num){
+		chain->wr[chain->num - 1].next = wr;
+	}
+	chain->num++;
+}
 
-        if(ibv_post_recv(ss->qp, &wr, &bad_wr) != 0){
-                exit(EXIT_FAILURE);
-        }
+/*
+ * Per WR buffer of the send with sequence number 'seq'. It is reused only
+ * after ring_size newer WRs, i.e. once its send completed.
+ */
+static uint8_t *nvoib_tx_hdr(struct nvoib_queue *queue, uint32_t seq){
+	return queue->tx_hdr + (seq % queue->ring_size) * queue->tx_hdr_size;
 }
 
-void nvoib_request_send(struct session *ss, struct nvoib_dev *dev,
-	uint64_t data_ptr, uint32_t size){
+/*
+ * The HCA gathers fewer SGEs than this WR has. Copy sge[from..] behind
+ * the first 'used' bytes of 'buf' and send all of it from there.
+ */
+static void nvoib_send_flatten(struct nvoib_queue *queue, struct ibv_send_wr *wr,
+	int from, uint8_t *buf, uint32_t used){
+	struct ibv_sge *sge = wr->sg_list;
+	int i;
+
+	for(i = from; i < wr->num_sge; i++){
+		memcpy(buf + used, (void *)(uintptr_t)sge[i].addr, sge[i].length);
+		used += sge[i].length;
+	}
 
-	struct ibv_send_wr wr, *bad_wr = NULL;
-	struct ibv_sge sge;
+	sge[0].addr = (uintptr_t)buf;
+	sge[0].length = used;
+	sge[0].lkey = queue->tx_hdr_mr->lkey;
+	wr->num_sge = 1;
+}
+
+/*
+ * 'frag' is the descriptor chain of one frame and 'index' its last slot.
+ * Returns -1 when the send queue is full and the slots must stay in the ring,
+ * non-zero when the slots can be handed back as soon as the chain is posted.
+ */
+int nvoib_request_send(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, uint32_t index, struct tx_frag *frag, int nfrags,
+	uint16_t desc_flags, uint16_t gso_size){
+
+	struct send_chain *chain = queue->tx_chain;
+	struct ibv_send_wr *wr;
+	struct ibv_sge *sge;
 	uintptr_t buffer;
 	struct forward_entry *entry;
+	uint8_t *reply = NULL;
+	uint32_t size = 0;
+	uint32_t reply_size = 0;
+	uint32_t remote_qpn;
+	int i;
+
+	buffer = (uintptr_t)dev->guest_memory + frag[0].data_ptr;
+
+	if(unlikely(desc_flags & DESC_F_GSO)){
+		return nvoib_request_send_gso(ss, dev, queue, index, frag, nfrags,
+			desc_flags, gso_size);
+	}
+
+	if(queue->tx_wr_seq - queue->tx_wr_done >= queue->ring_size){
+		return -1;
+	}
+
+	if(chain->num == TX_POLL_BADGET){
+		nvoib_post_send(queue);
+	}
+
+	for(i = 0; i < nfrags; i++){
+		size += frag[i].size;
+	}
+
+	/* a chain the HCA can not gather is copied, which needs it to fit one MTU */
+	if(unlikely(nfrags > dev->tx_sge) && size > queue->tx_hdr_size){
+		queue->tx_sge_dropped++;
+		dprintf("TX: dropped frame of %d slots we can not gather (size = %u)\n",
+			nfrags, size);
+		return 1;
+	}
+
+	/* ARP and NS frames are tiny and never fragmented */
+	if(unlikely(dev->arp_proxy) && nfrags == 1){
+		/* reply buffers are only free again once the chain is posted */
+		if(queue->proxy_used == PROXY_CHAIN_MAX){
+			nvoib_post_send(queue);
+		}
+
+		reply = queue->proxy_buf + queue->proxy_used * PROXY_FRAME_MAX;
+		reply_size = proxy_reply(&ss->neigh, (void *)buffer, size, reply);
+		if(reply_size){
+			queue->proxy_used++;
+		}
+	}
+
+	wr = &chain->wr[chain->num];
+	sge = chain->sge[chain->num];
+
+	memset(wr, 0, sizeof(struct ibv_send_wr));
+	wr->wr_id = ((uint64_t)++queue->tx_wr_seq << 32) | index;
+	wr->opcode = IBV_WR_SEND;
+	wr->sg_list = sge;
+	wr->num_sge = nfrags;
+
+	/* only every Nth send produces a completion, which retires the ones before it */
+	if(++queue->tx_unsignaled >= dev->tx_signal){
+		wr->send_flags |= IBV_SEND_SIGNALED;
+		queue->tx_unsignaled = 0;
+	}
+
+	if(size <= dev->tx_inline){
+		wr->send_flags |= IBV_SEND_INLINE;
+	}
+
+	if(unlikely(reply_size)){
+		/* the request is answered locally and takes the place of its slot */
+		entry = &ss->self;
+		remote_qpn = queue->qp->qp_num;
+		wr->send_flags |= IBV_SEND_INLINE;
+
+		sge[0].addr = (uintptr_t)reply;
+		sge[0].length = reply_size;
+		sge[0].lkey = ss->guest_memory_mr->lkey;
+	}else{
+		entry = tx_fdb_lookup(&ss->fdb, (void *)buffer);
+		remote_qpn = entry->qpn;
+
+		/* every fragment goes out straight from guest memory */
+		for(i = 0; i < nfrags; i++){
+			sge[i].addr = (uintptr_t)dev->guest_memory + frag[i].data_ptr;
+			sge[i].length = frag[i].size;
+			sge[i].lkey = ss->guest_memory_mr->lkey;
+		}
+
+		if(unlikely(nfrags > dev->tx_sge)){
+			nvoib_send_flatten(queue, wr, 0,
+				nvoib_tx_hdr(queue, TX_WR_SEQ(wr->wr_id)), 0);
+		}
+	}
+
+	wr->wr.ud.ah = entry->ah;
+	wr->wr.ud.remote_qpn = remote_qpn;
+	wr->wr.ud.remote_qkey = dev->tenant_id;
+
+	if(chain->num){
+		chain->wr[chain->num - 1].next = wr;
+	}
+	chain->num++;
+
+	dprintf("TX: request_send: dest_qpn = 0x%x, dest_qkey(tenant ID) = 0x%x\n",
+        remote_qpn, dev->tenant_id);
+
+	return wr->send_flags & IBV_SEND_INLINE;
+}
+
+/*
+ * Cut a TSO frame into UD sends of one IB MTU. Each segment gets its own
+ * copy of the headers, the payload is sent straight from guest memory
+ * and may take one SGE per slot it crosses.
+ */
+static int nvoib_request_send_gso(struct session *ss, struct nvoib_dev *dev,
+	struct nvoib_queue *queue, uint32_t index, struct tx_frag *frag, int nfrags,
+	uint16_t desc_flags, uint16_t gso_size){
+
+	struct send_chain *chain = queue->tx_chain;
+	struct ibv_send_wr *wr;
+	struct ibv_sge *sge;
+	struct forward_entry *entry;
+	struct gso_frame gf;
+	uint8_t *head, *hdr, *piece;
+	uint32_t seg, len, pos, take, size = 0;
+	uint32_t offset;	/* payload consumed in frag[cur] */
+	uint64_t sum;
+	int i, cur;
+
+	head = (uint8_t *)dev->guest_memory + frag[0].data_ptr;
+	for(i = 0; i < nfrags; i++){
+		size += frag[i].size;
+	}
+
+	if(gso_parse(&gf, head, frag[0].size, size, desc_flags, gso_size,
+	128 << ss->portinfo.active_mtu) < 0 || gf.segs > queue->ring_size){
+		/* the guest gets its slots back, nothing was sent */
+		queue->tx_gso_dropped++;
+		dprintf("TX: dropped GSO frame we can not segment (size = %u)\n", size);
+		return 1;
+	}
+
+	if(queue->tx_wr_seq - queue->tx_wr_done + gf.segs > queue->ring_size){
+		return -1;
+	}
+
+	entry = tx_fdb_lookup(&ss->fdb, head);
+
+	cur = 0;
+	offset = gf.hdr_len;
+
+	for(seg = 0; seg < gf.segs; seg++){
+		if(chain->num == TX_POLL_BADGET){
+			nvoib_post_send(queue);
+		}
+
+		wr = &chain->wr[chain->num];
+		sge = chain->sge[chain->num];
 
-	memset(&wr, 0, sizeof(wr));
-	buffer = (uintptr_t)dev->guest_memory + data_ptr;
+		memset(wr, 0, sizeof(struct ibv_send_wr));
+		wr->opcode = IBV_WR_SEND;
+		wr->sg_list = sge;
+		wr->num_sge = 1;
 
-	wr.wr_id = (uintptr_t)NULL;
-	wr.opcode = IBV_WR_SEND;
-	wr.sg_list = &sge;
-	wr.num_sge = 1;
-	wr.send_flags = IBV_SEND_SIGNALED;
+		/* walk the slots for this segment's payload, summing it on the way */
+		len = MIN(gf.mss, gf.payload - seg * gf.mss);
+		sum = 0;
+		for(pos = 0; pos < len; pos += take){
+			while(offset == frag[cur].size){
+				cur++;
+				offset = 0;
+			}
 
-	entry = tx_fdb_lookup(&ss->fdb, (void *)buffer);
-        wr.wr.ud.ah = entry->ah;
-        wr.wr.ud.remote_qpn = entry->qpn;
-        wr.wr.ud.remote_qkey = dev->tenant_id;
+			take = MIN(len - pos, frag[cur].size - offset);
+			piece = (uint8_t *)dev->guest_memory + frag[cur].data_ptr + offset;
+			sum = gso_csum_piece(sum, piece, take, pos);
 
-	sge.addr = buffer;
-	sge.length = size;
-	sge.lkey = ss->guest_memory_mr->lkey;
+			sge[wr->num_sge].addr = (uintptr_t)piece;
+			sge[wr->num_sge].length = take;
+			sge[wr->num_sge].lkey = ss->guest_memory_mr->lkey;
+			wr->num_sge++;
 
-	if(ibv_post_send(ss->qp, &wr, &bad_wr) != 0){
+			offset += take;
+		}
+
+		hdr = nvoib_tx_hdr(queue, queue->tx_wr_seq + 1);
+		gso_build(&gf, head, hdr, seg, len, sum);
+
+		sge[0].addr = (uintptr_t)hdr;
+		sge[0].length = gf.hdr_len;
+		sge[0].lkey = queue->tx_hdr_mr->lkey;
+
+		/* a segment crossing more slots than the HCA gathers goes behind its header */
+		if(unlikely(wr->num_sge > dev->tx_sge)){
+			nvoib_send_flatten(queue, wr, 1, hdr, gf.hdr_len);
+		}
+
+		wr->wr_id = ((uint64_t)++queue->tx_wr_seq << 32) | index;
+
+		/* the guest may reuse the buffer once the slot retires, so only the last one can */
+		queue->tx_unsignaled++;
+		if(seg != gf.segs - 1){
+			wr->wr_id |= TX_WR_NOSLOT;
+		}else if(queue->tx_unsignaled >= dev->tx_signal){
+			wr->send_flags |= IBV_SEND_SIGNALED;
+			queue->tx_unsignaled = 0;
+		}
+
+		wr->wr.ud.ah = entry->ah;
+		wr->wr.ud.remote_qpn = entry->qpn;
+		wr->wr.ud.remote_qkey = dev->tenant_id;
+
+		if(chain->num){
+			chain->wr[chain->num - 1].next = wr;
+		}
+		chain->num++;
+	}
+
+	dprintf("TX: request_send: %u bytes in %d slots cut into %u segments of %u\n",
+		size, nfrags, gf.segs, gf.mss);
+
+	return 0;
+}
+
+void nvoib_post_recv(struct nvoib_queue *queue){
+	struct recv_chain *chain = queue->rx_chain;
+	struct ibv_recv_wr *bad_wr = NULL;
+
+	if(!chain->num){
+		return;
+	}
+
+	if(ibv_post_recv(queue->qp, &chain->wr[0], &bad_wr) != 0){
+		printf("failed to ibv_post_recv\n");
+		exit(EXIT_FAILURE);
+	}
+
+	chain->num = 0;
+}
+
+void nvoib_post_send(struct nvoib_queue *queue){
+	struct send_chain *chain = queue->tx_chain;
+	struct ibv_send_wr *bad_wr = NULL;
+
+	if(!chain->num){
+		return;
+	}
+
+	/* signal the tail so the ring never waits for a send that will not come */
+	if(queue->tx_unsignaled){
+		chain->wr[chain->num - 1].send_flags |= IBV_SEND_SIGNALED;
+		queue->tx_unsignaled = 0;
+	}
+
+	if(ibv_post_send(queue->qp, &chain->wr[0], &bad_wr) != 0){
 		printf("failed to ibv_post_send\n");
 		exit(EXIT_FAILURE);
 	}
 
-	dprintf("TX: request_send: dest_qpn = 0x%x, dest_qkey(tenant ID) = 0x%x\n",
-        entry->qpn, dev->tenant_id);
+	dprintf("TX: posted %d WRs by one doorbell\n", chain->num);
+	chain->num = 0;
+	queue->proxy_used = 0;
 }